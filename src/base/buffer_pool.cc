@@ -0,0 +1,207 @@
+/*
+ * base/buffer_pool.cc
+ * -------------------------------------------------------------------------
+ * Pool of reusable transfer buffers (implementation).
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "base/buffer_pool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "base/statistics.h"
+
+namespace s3 {
+namespace base {
+
+namespace {
+constexpr size_t MIN_CLASS_SIZE = 4 * 1024;
+constexpr int NUM_CLASSES = 13;  // 4 KB to 16 MB
+constexpr size_t MAX_CLASS_SIZE = MIN_CLASS_SIZE << (NUM_CLASSES - 1);
+
+// buffers of each size class that a thread keeps for itself. larger buffers
+// always go back to the shared pool, which bounds what it keeps idle, so that
+// no thread sits on megabytes it isn't using.
+constexpr size_t THREAD_CACHE_BUFFERS = 1;
+constexpr size_t MAX_THREAD_CACHE_CLASS_SIZE = 1024 * 1024;
+// bytes of idle buffers that the shared pool will hold on to
+constexpr size_t MAX_SHARED_IDLE_BYTES = 64 * 1024 * 1024;
+
+std::atomic_int s_hits(0), s_misses(0), s_unpooled(0);
+std::atomic<uint64_t> s_bytes_resident(0);
+
+void StatsWriter(std::ostream *o) {
+  *o << "buffer pool:\n"
+        "  hits: "
+     << s_hits
+     << "\n"
+        "  misses: "
+     << s_misses
+     << "\n"
+        "  too large to pool: "
+     << s_unpooled
+     << "\n"
+        "  bytes resident: "
+     << s_bytes_resident << "\n";
+}
+
+Statistics::Writers::Entry s_writer(StatsWriter, 0);
+
+// returns -1 if "size" is too large to be pooled
+int GetSizeClass(size_t size) {
+  size_t class_size = MIN_CLASS_SIZE;
+  for (int i = 0; i < NUM_CLASSES; i++, class_size <<= 1)
+    if (size <= class_size) return i;
+  return -1;
+}
+
+struct SharedPool {
+  std::mutex mutex;
+  std::vector<char *> buffers[NUM_CLASSES];
+  size_t idle_bytes = 0;
+};
+
+// never destroyed, since thread caches may return buffers to it at exit
+SharedPool *GetSharedPool() {
+  static auto *pool = new SharedPool();
+  return pool;
+}
+
+void Free(char *data, size_t capacity) {
+  delete[] data;
+  s_bytes_resident -= capacity;
+}
+
+// hands buffers back to the shared pool, or frees them if it's full
+void PutShared(char *data, size_t capacity, int size_class) {
+  SharedPool *pool = GetSharedPool();
+
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (pool->idle_bytes + capacity <= MAX_SHARED_IDLE_BYTES) {
+      pool->buffers[size_class].push_back(data);
+      pool->idle_bytes += capacity;
+      return;
+    }
+  }
+
+  Free(data, capacity);
+}
+
+class ThreadCache {
+ public:
+  ~ThreadCache() {
+    for (int i = 0; i < NUM_CLASSES; i++)
+      for (char *data : buffers[i]) PutShared(data, MIN_CLASS_SIZE << i, i);
+  }
+
+  std::vector<char *> buffers[NUM_CLASSES];
+};
+
+thread_local ThreadCache t_cache;
+}  // namespace
+
+BufferPool::Buffer::Buffer(char *data, size_t size, size_t capacity)
+    : data_(data), size_(size), capacity_(capacity) {}
+
+BufferPool::Buffer::Buffer(Buffer &&other)
+    : data_(other.data_), size_(other.size_), capacity_(other.capacity_) {
+  other.data_ = nullptr;
+  other.size_ = other.capacity_ = 0;
+}
+
+BufferPool::Buffer::~Buffer() { Release(); }
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) {
+  if (this != &other) {
+    Release();
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+  return *this;
+}
+
+void BufferPool::Buffer::Release() {
+  if (data_) BufferPool::Put(data_, capacity_);
+  data_ = nullptr;
+  size_ = capacity_ = 0;
+}
+
+BufferPool::Buffer BufferPool::Get(size_t size) {
+  if (size == 0) return Buffer();
+
+  const int size_class = GetSizeClass(size);
+
+  if (size_class == -1) {
+    ++s_unpooled;
+    s_bytes_resident += size;
+    return Buffer(new char[size], size, size);
+  }
+
+  const size_t capacity = MIN_CLASS_SIZE << size_class;
+  std::vector<char *> *local = &t_cache.buffers[size_class];
+
+  if (capacity <= MAX_THREAD_CACHE_CLASS_SIZE && !local->empty()) {
+    char *data = local->back();
+    local->pop_back();
+    ++s_hits;
+    return Buffer(data, size, capacity);
+  }
+
+  {
+    SharedPool *pool = GetSharedPool();
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    std::vector<char *> *shared = &pool->buffers[size_class];
+
+    if (!shared->empty()) {
+      char *data = shared->back();
+      shared->pop_back();
+      pool->idle_bytes -= capacity;
+      ++s_hits;
+      return Buffer(data, size, capacity);
+    }
+  }
+
+  ++s_misses;
+  s_bytes_resident += capacity;
+  return Buffer(new char[capacity], size, capacity);
+}
+
+void BufferPool::Put(char *data, size_t capacity) {
+  if (capacity > MAX_CLASS_SIZE) {
+    Free(data, capacity);
+    return;
+  }
+
+  const int size_class = GetSizeClass(capacity);
+  std::vector<char *> *local = &t_cache.buffers[size_class];
+
+  if (capacity <= MAX_THREAD_CACHE_CLASS_SIZE &&
+      local->size() < THREAD_CACHE_BUFFERS)
+    local->push_back(data);
+  else
+    PutShared(data, capacity, size_class);
+}
+
+}  // namespace base
+}  // namespace s3
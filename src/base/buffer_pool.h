@@ -0,0 +1,68 @@
+/*
+ * base/buffer_pool.h
+ * -------------------------------------------------------------------------
+ * Pool of reusable transfer buffers.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_BUFFER_POOL_H
+#define S3_BASE_BUFFER_POOL_H
+
+#include <stddef.h>
+
+namespace s3 {
+namespace base {
+// hands out uninitialized buffers in power-of-two size classes, and keeps
+// them for reuse once they're released. each thread keeps a small buffer of
+// each size of its own so that most requests don't touch the shared pool.
+class BufferPool {
+ public:
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(Buffer &&other);
+    ~Buffer();
+
+    Buffer &operator=(Buffer &&other);
+
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    inline char *get() const { return data_; }
+    inline size_t size() const { return size_; }
+
+   private:
+    friend class BufferPool;
+
+    Buffer(char *data, size_t size, size_t capacity);
+
+    void Release();
+
+    char *data_ = nullptr;
+    size_t size_ = 0, capacity_ = 0;
+  };
+
+  // returns a buffer of "size" bytes, with unspecified contents
+  static Buffer Get(size_t size);
+
+ private:
+  static void Put(char *data, size_t capacity);
+};
+}  // namespace base
+}  // namespace s3
+
+#endif
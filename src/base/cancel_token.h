@@ -0,0 +1,43 @@
+/*
+ * base/cancel_token.h
+ * -------------------------------------------------------------------------
+ * Lets one thread ask work in progress on others to stop early.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_CANCEL_TOKEN_H
+#define S3_BASE_CANCEL_TOKEN_H
+
+#include <atomic>
+
+namespace s3 {
+namespace base {
+// work that's handed a token checks it between (and, for requests, during)
+// steps, and fails with -ECANCELED once it's been cancelled
+class CancelToken {
+ public:
+  inline void Cancel() { cancelled_ = true; }
+  inline void Reset() { cancelled_ = false; }
+  inline bool cancelled() const { return cancelled_; }
+
+ private:
+  std::atomic_bool cancelled_{false};
+};
+}  // namespace base
+}  // namespace s3
+
+#endif
@@ -57,7 +57,8 @@ uint64_t s_total_bytes = 0;
 double s_run_time = 0.0;
 
 std::atomic_int s_curl_failures(0), s_request_failures(0);
-std::atomic_int s_timeouts(0), s_aborts(0), s_hook_retries(0);
+std::atomic_int s_timeouts(0), s_aborts(0), s_cancellations(0),
+    s_hook_retries(0);
 std::atomic_int s_rewinds(0);
 std::mutex s_stats_mutex;
 
@@ -120,6 +121,9 @@ void StatsWriter(std::ostream *o) {
      << "\n"
         "  aborts: "
      << s_aborts
+     << "\n"
+        "  cancellations: "
+     << s_cancellations
      << "\n"
         "  hook retries: "
      << s_hook_retries
@@ -281,10 +285,16 @@ void Request::Init(HttpMethod method) {
   transport_url_.clear();
   response_headers_.clear();
   output_buffer_.clear();
+  output_sink_ = nullptr;
+  output_sink_error_ = 0;
   response_code_ = 0;
   last_modified_ = 0;
   headers_.clear();
   input_buffer_.clear();
+  input_source_ = nullptr;
+  input_source_size_ = 0;
+  input_source_error_ = 0;
+  cancel_token_ = nullptr;
 
   TEST_OK(curl_easy_setopt(transport_->curl(), CURLOPT_CUSTOMREQUEST, nullptr));
   TEST_OK(curl_easy_setopt(transport_->curl(), CURLOPT_UPLOAD, false));
@@ -337,6 +347,18 @@ void Request::SetInputBuffer(const std::string &str) {
   str.copy(&input_buffer_[0], str.size());
 }
 
+void Request::SetInputSource(InputSource source, size_t size) {
+  input_buffer_.clear();
+  input_source_ = std::move(source);
+  input_source_size_ = size;
+}
+
+void Request::SetOutputSink(OutputSink sink) { output_sink_ = std::move(sink); }
+
+void Request::SetCancelToken(const CancelToken *token) {
+  cancel_token_ = token;
+}
+
 void Request::ResetCurrentRunTime() { current_run_time_ = 0.0; }
 
 void Request::Run(int timeout_in_s) {
@@ -350,11 +372,11 @@ void Request::Run(int timeout_in_s) {
 
   if (method_ == HttpMethod::PUT)
     TEST_OK(curl_easy_setopt(transport_->curl(), CURLOPT_INFILESIZE_LARGE,
-                             static_cast<curl_off_t>(input_buffer_.size())));
+                             static_cast<curl_off_t>(input_size())));
   else if (method_ == HttpMethod::POST)
     TEST_OK(curl_easy_setopt(transport_->curl(), CURLOPT_POSTFIELDSIZE_LARGE,
-                             static_cast<curl_off_t>(input_buffer_.size())));
-  else if (!input_buffer_.empty())
+                             static_cast<curl_off_t>(input_size())));
+  else if (input_size() > 0)
     throw std::runtime_error(
         "can't set input data for non-POST/non-PUT request.");
 
@@ -377,12 +399,14 @@ void Request::Run(int timeout_in_s) {
     TEST_OK(curl_easy_setopt(transport_->curl(), CURLOPT_HTTPHEADER,
                              headers.get()));
 
-    request_size += input_buffer_.size();
+    request_size += input_size();
 
     Rewind();
 
     transport_error_[0] = '\0';
     output_buffer_.clear();
+    output_size_ = 0;
+    output_to_sink_ = false;
     response_headers_.clear();
 
     deadline_ = time(nullptr) + ((timeout_in_s == DEFAULT_REQUEST_TIMEOUT)
@@ -392,6 +416,12 @@ void Request::Run(int timeout_in_s) {
     GetHttpMethodCounters()->Increment(method_);
     r = curl_easy_perform(transport_->curl());
 
+    // the sink or source failed, or we've been told to stop, so there's no
+    // point in trying again
+    if (r != CURLE_OK &&
+        (output_sink_error_ || input_source_error_ || cancelled()))
+      break;
+
     switch (r) {
       case CURLE_COULDNT_RESOLVE_PROXY:
       case CURLE_COULDNT_RESOLVE_HOST:
@@ -439,7 +469,7 @@ void Request::Run(int timeout_in_s) {
                                 &last_modified_));
 
       elapsed_time += this_iter_et;
-      bytes_transferred += request_size + output_buffer_.size();
+      bytes_transferred += request_size + output_size_;
 
       if (hook_ && hook_->ShouldRetry(this, iter)) {
         ++s_hook_retries;
@@ -452,6 +482,20 @@ void Request::Run(int timeout_in_s) {
     break;
   }
 
+  if (r != CURLE_OK && cancelled()) {
+    ++s_cancellations;
+    S3_LOG(LOG_DEBUG, "Request::Run", "cancelled request for [%s].\n",
+           url_.c_str());
+    return;
+  }
+
+  if (r != CURLE_OK && (output_sink_error_ || input_source_error_)) {
+    S3_LOG(LOG_WARNING, "Request::Run",
+           "transfer for [%s] failed with sink error %i, source error %i.\n",
+           url_.c_str(), output_sink_error_, input_source_error_);
+    return;
+  }
+
   if (r != CURLE_OK) {
     ++s_aborts;
     throw std::runtime_error(error);
@@ -505,6 +549,24 @@ size_t Request::WriteOutput(char *data, size_t size, size_t items) {
   // why even bother with "items"?
   size *= items;
 
+  if (output_sink_ && output_size_ == 0 && !output_to_sink_) {
+    // only successful responses go to the sink; we keep error responses
+    // around so that they can be logged
+    long code = 0;
+    curl_easy_getinfo(transport_->curl(), CURLINFO_RESPONSE_CODE, &code);
+    response_code_ = code;
+    output_to_sink_ =
+        (code >= HTTP_SC_OK && code < HTTP_SC_MULTIPLE_CHOICES);
+  }
+
+  const off_t offset = output_size_;
+  output_size_ += size;
+
+  if (output_to_sink_) {
+    output_sink_error_ = output_sink_(data, size, offset);
+    return output_sink_error_ ? 0 : size;
+  }
+
   size_t old_size = output_buffer_.size();
   output_buffer_.resize(old_size + size);
   memcpy(&output_buffer_[old_size], data, size);
@@ -516,6 +578,18 @@ size_t Request::ReadInput(char *data, size_t size, size_t items) {
   size *= items;
 
   size_t remaining = std::min(input_remaining_, size);
+
+  if (input_source_) {
+    // read straight into curl's buffer
+    const off_t offset = input_source_size_ - input_remaining_;
+    if (remaining > 0) {
+      input_source_error_ = input_source_(remaining, offset, data);
+      if (input_source_error_) return CURL_READFUNC_ABORT;
+    }
+    input_remaining_ -= remaining;
+    return remaining;
+  }
+
   memcpy(data, input_pos_, remaining);
   input_pos_ += remaining;
   input_remaining_ -= remaining;
@@ -527,6 +601,13 @@ int Request::SeekInput(off_t offset, int origin) {
   S3_LOG(LOG_DEBUG, "Request::SeekInput", "seek to [%jd] from [%i] for [%s]\n",
          static_cast<intmax_t>(offset), origin, url_.c_str());
 
+  if (input_source_ && origin == SEEK_SET && offset >= 0 &&
+      static_cast<size_t>(offset) <= input_source_size_) {
+    input_remaining_ = input_source_size_ - offset;
+    ++s_rewinds;
+    return CURL_SEEKFUNC_OK;
+  }
+
   if (origin != SEEK_SET || offset != 0) return CURL_SEEKFUNC_FAIL;
 
   Rewind();
@@ -536,6 +617,8 @@ int Request::SeekInput(off_t offset, int origin) {
 
 int Request::Progress(off_t dl_total, off_t dl_now, off_t ul_total,
                       off_t ul_now) {
+  if (cancelled()) return 1;
+
   if (time(nullptr) > deadline_) {
     S3_LOG(LOG_DEBUG, "Request::Progress", "time out for [%s]\n", url_.c_str());
     return 1;
@@ -544,9 +627,13 @@ int Request::Progress(off_t dl_total, off_t dl_now, off_t ul_total,
   return 0;
 }
 
+size_t Request::input_size() const {
+  return input_source_ ? input_source_size_ : input_buffer_.size();
+}
+
 void Request::Rewind() {
   input_pos_ = input_buffer_.empty() ? nullptr : &input_buffer_[0];
-  input_remaining_ = input_buffer_.size();
+  input_remaining_ = input_size();
 }
 
 }  // namespace base
@@ -25,11 +25,14 @@
 #include <stdio.h>
 
 #include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "base/cancel_token.h"
+
 namespace s3 {
 namespace base {
 enum class HttpMethod { INVALID, DELETE, GET, HEAD, POST, PUT };
@@ -41,6 +44,7 @@ enum HttpStatusCode {
   HTTP_SC_NO_CONTENT = 204,
   HTTP_SC_PARTIAL_CONTENT = 206,
   HTTP_SC_MULTIPLE_CHOICES = 300,
+  HTTP_SC_NOT_MODIFIED = 304,
   HTTP_SC_RESUME = 308,
   HTTP_SC_BAD_REQUEST = 400,
   HTTP_SC_UNAUTHORIZED = 401,
@@ -71,6 +75,16 @@ class Request {
  public:
   static constexpr int DEFAULT_REQUEST_TIMEOUT = -1;
 
+  // receives the body of a successful (2xx) response as it arrives, along
+  // with the offset of each piece within the body. returning anything other
+  // than 0 aborts the request. bodies of other responses still go to
+  // output_buffer().
+  using OutputSink = std::function<int(const char *, size_t, off_t)>;
+  // fills the buffer with the given number of bytes of the request body,
+  // starting at the given offset. called as the body is sent (and again if
+  // it's resent), so it must return the same data each time.
+  using InputSource = std::function<int(size_t, off_t, char *)>;
+
   ~Request();
 
   void Init(HttpMethod method);
@@ -87,8 +101,15 @@ class Request {
   }
   inline const HeaderMap &response_headers() const { return response_headers_; }
   inline int response_code() const { return response_code_; }
+  // size of the response body, whether or not it went to the output sink
+  inline size_t output_size() const { return output_size_; }
+  inline int output_sink_error() const { return output_sink_error_; }
+  inline int input_source_error() const { return input_source_error_; }
   inline time_t last_modified() const { return last_modified_; }
   inline double current_run_time() const { return current_run_time_; }
+  inline bool cancelled() const {
+    return cancel_token_ && cancel_token_->cancelled();
+  }
 
   std::string GetOutputAsString() const;
 
@@ -96,6 +117,11 @@ class Request {
   void SetHeader(const std::string &name, const std::string &value);
   void SetInputBuffer(std::vector<char> &&buffer);
   void SetInputBuffer(const std::string &str);
+  void SetInputSource(InputSource source, size_t size);
+  void SetOutputSink(OutputSink sink);
+  // abandons the request, without retrying, once "token" is cancelled. the
+  // token must outlive Run().
+  void SetCancelToken(const CancelToken *token);
 
   void ResetCurrentRunTime();
 
@@ -137,6 +163,7 @@ class Request {
   int SeekInput(off_t offset, int origin);
   int Progress(off_t dl_total, off_t dl_now, off_t ul_total, off_t ul_now);
 
+  size_t input_size() const;
   void Rewind();
 
   // not reset by Init()
@@ -157,6 +184,12 @@ class Request {
   HeaderMap response_headers_;
 
   std::vector<char> output_buffer_;
+  OutputSink output_sink_;
+  int output_sink_error_ = 0;
+
+  // reset for each attempt by Run()
+  size_t output_size_ = 0;
+  bool output_to_sink_ = false;
 
   int response_code_ = 0;
   time_t last_modified_ = 0;
@@ -165,8 +198,13 @@ class Request {
   HeaderMap headers_;
 
   std::vector<char> input_buffer_;
+  InputSource input_source_;
+  size_t input_source_size_ = 0;
+  int input_source_error_ = 0;
+
+  const CancelToken *cancel_token_ = nullptr;
 
-  // reset only by Rewind()
+  // reset only by Rewind() and SeekInput()
   const char *input_pos_ = nullptr;
   size_t input_remaining_ = 0;
 };
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#include "base/buffer_pool.h"
+
+namespace s3 {
+namespace base {
+namespace tests {
+
+TEST(BufferPool, EmptyBuffer) {
+  auto buffer = BufferPool::Get(0);
+  EXPECT_EQ(nullptr, buffer.get());
+  EXPECT_EQ(0u, buffer.size());
+}
+
+TEST(BufferPool, ReusesReleasedBuffers) {
+  char *data = nullptr;
+
+  {
+    auto buffer = BufferPool::Get(100 * 1024);
+    ASSERT_NE(nullptr, buffer.get());
+    EXPECT_EQ(100u * 1024, buffer.size());
+    memset(buffer.get(), 0xff, buffer.size());
+    data = buffer.get();
+  }
+
+  // same size class, so we should get the same buffer back
+  auto buffer = BufferPool::Get(128 * 1024);
+  EXPECT_EQ(data, buffer.get());
+  EXPECT_EQ(128u * 1024, buffer.size());
+}
+
+TEST(BufferPool, SizeClassesAreSeparate) {
+  char *small_data = nullptr;
+
+  {
+    auto small = BufferPool::Get(1024);
+    small_data = small.get();
+  }
+
+  auto large = BufferPool::Get(1024 * 1024);
+  EXPECT_NE(small_data, large.get());
+}
+
+TEST(BufferPool, Move) {
+  auto a = BufferPool::Get(5000);
+  char *data = a.get();
+
+  BufferPool::Buffer b(std::move(a));
+  EXPECT_EQ(nullptr, a.get());
+  EXPECT_EQ(data, b.get());
+  EXPECT_EQ(5000u, b.size());
+
+  BufferPool::Buffer c;
+  c = std::move(b);
+  EXPECT_EQ(nullptr, b.get());
+  EXPECT_EQ(data, c.get());
+}
+
+TEST(BufferPool, LargeBuffers) {
+  auto buffer = BufferPool::Get(64 * 1024 * 1024);
+  ASSERT_NE(nullptr, buffer.get());
+  memset(buffer.get(), 0, buffer.size());
+}
+
+TEST(BufferPool, ThreadExitReturnsBuffers) {
+  char *data = nullptr;
+
+  std::thread t([&data]() {
+    // the buffer stays in this thread's cache until the thread exits
+    auto buffer = BufferPool::Get(300 * 1024);
+    data = buffer.get();
+  });
+  t.join();
+
+  auto buffer = BufferPool::Get(300 * 1024);
+  EXPECT_EQ(data, buffer.get());
+}
+
+}  // namespace tests
+}  // namespace base
+}  // namespace s3
@@ -22,6 +22,7 @@
 #ifndef S3_CRYPTO_HASH_LIST_H
 #define S3_CRYPTO_HASH_LIST_H
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <stdexcept>
@@ -62,6 +63,27 @@ class HashList {
     }
   }
 
+  // keeps the hashes of chunks that are still (entirely) within "total_size"
+  inline void Resize(size_t total_size) {
+    hashes_.resize((total_size + CHUNK_SIZE - 1) / CHUNK_SIZE *
+                   HashType::HASH_LEN);
+  }
+
+  // copies the hashes in "part", which covers data starting at (the
+  // chunk-aligned) "offset"
+  inline void Import(size_t offset, const HashList &part) {
+    const size_t start = offset / CHUNK_SIZE * HashType::HASH_LEN;
+
+    if (offset % CHUNK_SIZE)
+      throw std::runtime_error(
+          "cannot import hashes if offset is not chunk-aligned");
+    if (start + part.hashes_.size() > hashes_.size())
+      throw std::runtime_error("imported hashes out of range");
+
+    std::copy(part.hashes_.begin(), part.hashes_.end(),
+              hashes_.begin() + start);
+  }
+
   template <class EncoderType>
   inline std::string GetRootHash() {
     uint8_t root_hash[HashType::HASH_LEN];
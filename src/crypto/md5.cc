@@ -31,6 +31,21 @@
 namespace s3 {
 namespace crypto {
 
+Md5::Incremental::Incremental() : ctx_(EVP_MD_CTX_new()) {
+  if (!ctx_) throw std::runtime_error("failed to allocate md5 context.");
+  EVP_DigestInit(ctx_, EVP_md5());
+}
+
+Md5::Incremental::~Incremental() { EVP_MD_CTX_free(ctx_); }
+
+void Md5::Incremental::Update(const uint8_t *input, size_t size) {
+  EVP_DigestUpdate(ctx_, input, size);
+}
+
+void Md5::Incremental::Finish(uint8_t *hash) {
+  EVP_DigestFinal(ctx_, hash, nullptr);
+}
+
 void Md5::Compute(const uint8_t *input, size_t size, uint8_t *hash) {
   MD5(input, size, hash);
 }
@@ -22,9 +22,13 @@
 #ifndef S3_CRYPTO_MD5_H
 #define S3_CRYPTO_MD5_H
 
+#include <stddef.h>
+
 #include <cstdint>
 #include <string>
 
+struct evp_md_ctx_st;
+
 namespace s3 {
 namespace crypto {
 class Hash;
@@ -47,6 +51,19 @@ class Md5 {
     return true;
   }
 
+  // for data that's hashed a piece at a time
+  class Incremental {
+   public:
+    Incremental();
+    ~Incremental();
+
+    void Update(const uint8_t *input, size_t size);
+    void Finish(uint8_t *hash);
+
+   private:
+    evp_md_ctx_st *ctx_ = nullptr;
+  };
+
  private:
   friend class Hash;
 
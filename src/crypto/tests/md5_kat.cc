@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdint>
 #include <gtest/gtest.h>
 
@@ -45,6 +46,23 @@ TEST(Md5, KnownAnswers) {
   }
 }
 
+TEST(Md5, KnownAnswersIncremental) {
+  for (const auto &kat : TESTS) {
+    std::vector<uint8_t> in = Encoder::Decode<Hex>(kat.message);
+    uint8_t hash[Md5::HASH_LEN];
+    Md5::Incremental md5;
+
+    // feed the message in uneven pieces
+    for (size_t offset = 0, piece = 1; offset < in.size();
+         offset += piece, piece++)
+      md5.Update(&in[offset], std::min(piece, in.size() - offset));
+    md5.Finish(hash);
+
+    EXPECT_EQ(std::string(kat.hash), Encoder::Encode<Hex>(hash, Md5::HASH_LEN))
+        << "for kat = " << kat.message;
+  }
+}
+
 }  // namespace tests
 }  // namespace crypto
 }  // namespace s3
@@ -0,0 +1,278 @@
+/*
+ * fs/block_cache.cc
+ * -------------------------------------------------------------------------
+ * On-disk block cache implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fs/block_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/statistics.h"
+#include "crypto/hash.h"
+#include "crypto/hex.h"
+#include "crypto/sha256.h"
+
+namespace s3 {
+namespace fs {
+
+namespace {
+constexpr char TEMP_PREFIX[] = ".tmp-";
+
+// block names are the hex-encoded key, a dot, and the block index
+constexpr size_t KEY_LEN = crypto::Sha256::HASH_LEN * 2;
+
+struct Block {
+  size_t size;
+  std::list<std::string>::iterator lru;
+};
+
+std::mutex s_mutex;
+std::string s_dir;
+size_t s_max_size = 0, s_size = 0;
+std::list<std::string> s_lru;  // oldest first
+std::unordered_map<std::string, Block> s_blocks;
+
+std::atomic_int s_hits(0), s_misses(0), s_stores(0), s_store_failures(0),
+    s_evictions(0);
+
+void StatsWriter(std::ostream *o) {
+  if (s_dir.empty()) return;
+  *o << "block cache:\n"
+        "  hits: "
+     << s_hits
+     << "\n"
+        "  misses: "
+     << s_misses
+     << "\n"
+        "  stored: "
+     << s_stores << ", failed: " << s_store_failures
+     << "\n"
+        "  evictions: "
+     << s_evictions << "\n";
+}
+
+base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
+
+inline std::string GetBlockName(const std::string &key, size_t index) {
+  return key + "." + std::to_string(index);
+}
+
+inline std::string GetBlockPath(const std::string &name) {
+  return s_dir + "/" + name;
+}
+
+// call with s_mutex held
+void RemoveBlock(const std::string name) {
+  auto iter = s_blocks.find(name);
+  if (iter == s_blocks.end()) return;
+
+  s_size -= iter->second.size;
+  s_lru.erase(iter->second.lru);
+  s_blocks.erase(iter);
+
+  unlink(GetBlockPath(name).c_str());
+}
+
+// call with s_mutex held
+void AddBlock(const std::string &name, size_t size) {
+  RemoveBlock(name);
+
+  Block *block = &s_blocks[name];
+  block->size = size;
+  block->lru = s_lru.insert(s_lru.end(), name);
+  s_size += size;
+
+  while (s_size > s_max_size) {
+    RemoveBlock(s_lru.front());
+    ++s_evictions;
+  }
+}
+}  // namespace
+
+void BlockCache::Init() {
+  struct Found {
+    std::string name;
+    size_t size;
+    time_t mtime;
+  };
+
+  s_dir = base::Config::block_cache_dir();
+  if (s_dir.empty()) return;
+
+  s_max_size = base::Config::block_cache_size();
+
+  if (mkdir(s_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    S3_LOG(LOG_ERR, "BlockCache::Init", "failed to create [%s]: %s\n",
+           s_dir.c_str(), strerror(errno));
+    throw std::runtime_error("failed to create block cache directory");
+  }
+
+  DIR *dir = opendir(s_dir.c_str());
+  if (!dir) {
+    S3_LOG(LOG_ERR, "BlockCache::Init", "failed to open [%s]: %s\n",
+           s_dir.c_str(), strerror(errno));
+    throw std::runtime_error("failed to open block cache directory");
+  }
+
+  std::vector<Found> found;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir))) {
+    const std::string name = entry->d_name;
+    struct stat s;
+
+    if (name.compare(0, sizeof(TEMP_PREFIX) - 1, TEMP_PREFIX) == 0) {
+      // left over from an interrupted Put()
+      unlink(GetBlockPath(name).c_str());
+      continue;
+    }
+
+    // leave anything that isn't ours alone
+    if (name.size() <= KEY_LEN + 1 || name[KEY_LEN] != '.') continue;
+    if (stat(GetBlockPath(name).c_str(), &s) == -1 || !S_ISREG(s.st_mode))
+      continue;
+
+    found.push_back({name, static_cast<size_t>(s.st_size), s.st_mtime});
+  }
+
+  closedir(dir);
+
+  // blocks are touched whenever they're read, so mtime approximates the order
+  // in which they were last used
+  std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+    return a.mtime < b.mtime;
+  });
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_blocks.clear();
+  s_lru.clear();
+  s_size = 0;
+  for (const auto &f : found) AddBlock(f.name, f.size);
+
+  S3_LOG(LOG_DEBUG, "BlockCache::Init", "%zu blocks (%zu bytes) in [%s].\n",
+         s_blocks.size(), s_size, s_dir.c_str());
+}
+
+std::string BlockCache::GetKey(const std::string &path,
+                               const std::string &etag, size_t block_size) {
+  if (s_dir.empty() || etag.empty()) return "";
+  return crypto::Hash::Compute<crypto::Sha256, crypto::Hex>(
+      path + "\n" + etag + "\n" + std::to_string(block_size));
+}
+
+bool BlockCache::Get(const std::string &key, size_t index, size_t size,
+                     char *buffer) {
+  const std::string name = GetBlockName(key, index);
+
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto iter = s_blocks.find(name);
+
+    if (iter == s_blocks.end() || iter->second.size != size) {
+      ++s_misses;
+      return false;
+    }
+
+    s_lru.splice(s_lru.end(), s_lru, iter->second.lru);
+  }
+
+  int fd = open(GetBlockPath(name).c_str(), O_RDONLY);
+  ssize_t r = -1;
+
+  if (fd != -1) {
+    r = pread(fd, buffer, size, 0);
+    if (r == static_cast<ssize_t>(size)) futimens(fd, nullptr);
+    close(fd);
+  }
+
+  if (r != static_cast<ssize_t>(size)) {
+    S3_LOG(LOG_WARNING, "BlockCache::Get", "failed to read block [%s].\n",
+           name.c_str());
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    RemoveBlock(name);
+    ++s_misses;
+    return false;
+  }
+
+  ++s_hits;
+  return true;
+}
+
+void BlockCache::Put(const std::string &key, size_t index, const char *buffer,
+                     size_t size) {
+  if (size > s_max_size) return;
+
+  const std::string name = GetBlockName(key, index);
+  std::string temp_path = GetBlockPath(std::string(TEMP_PREFIX) + "XXXXXX");
+
+  // write to a temporary file first so that a crash never leaves a partial
+  // block behind
+  int fd = mkstemp(&temp_path[0]);
+  if (fd == -1) {
+    ++s_store_failures;
+    return;
+  }
+
+  ssize_t r = pwrite(fd, buffer, size, 0);
+  close(fd);
+
+  if (r != static_cast<ssize_t>(size) ||
+      rename(temp_path.c_str(), GetBlockPath(name).c_str()) == -1) {
+    S3_LOG(LOG_WARNING, "BlockCache::Put", "failed to store block [%s].\n",
+           name.c_str());
+    unlink(temp_path.c_str());
+    ++s_store_failures;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  AddBlock(name, size);
+  ++s_stores;
+}
+
+void BlockCache::Erase(const std::string &key) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  std::vector<std::string> names;
+
+  for (const auto &block : s_blocks) {
+    if (block.first.size() > key.size() &&
+        block.first.compare(0, key.size(), key) == 0 &&
+        block.first[key.size()] == '.')
+      names.push_back(block.first);
+  }
+
+  for (const auto &name : names) RemoveBlock(name);
+}
+}  // namespace fs
+}  // namespace s3
@@ -0,0 +1,52 @@
+/*
+ * fs/block_cache.h
+ * -------------------------------------------------------------------------
+ * Caches downloaded file contents on disk, across opens and remounts.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_BLOCK_CACHE_H
+#define S3_FS_BLOCK_CACHE_H
+
+#include <string>
+
+namespace s3 {
+namespace fs {
+class BlockCache {
+ public:
+  static void Init();
+
+  // returns the key under which blocks of "block_size" bytes of the object at
+  // "path" with "etag" are cached, or an empty string if the cache is disabled
+  static std::string GetKey(const std::string &path, const std::string &etag,
+                            size_t block_size);
+
+  // reads block "index" into "buffer", which must hold "size" bytes. returns
+  // false unless the block is cached and is "size" bytes long.
+  static bool Get(const std::string &key, size_t index, size_t size,
+                  char *buffer);
+
+  static void Put(const std::string &key, size_t index, const char *buffer,
+                  size_t size);
+
+  // removes every block cached under "key"
+  static void Erase(const std::string &key);
+};
+}  // namespace fs
+}  // namespace s3
+
+#endif
@@ -23,7 +23,13 @@
 
 #include <atomic>
 #include <cstdint>
+#include <future>
+#include <map>
 #include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
 
 #include "base/config.h"
 #include "base/logger.h"
@@ -31,33 +37,80 @@
 #include "base/request.h"
 #include "base/statistics.h"
 #include "fs/directory.h"
+#include "fs/missing_paths.h"
 #include "fs/object.h"
+#include "services/service.h"
 #include "threads/pool.h"
 
 namespace s3 {
 namespace fs {
 namespace {
+// the cache is split into shards, by path, so that lookups of different
+// objects don't contend for one lock. hits only need a shard's shared lock.
+constexpr size_t NUM_SHARDS = 16;
+
 inline bool IsObjectRemovable(const std::shared_ptr<Object> &obj) {
   return !obj || obj->IsRemovable();
 }
 
-std::mutex s_mutex;
-std::unique_ptr<
-    base::LruCacheMap<std::string, std::shared_ptr<Object>, IsObjectRemovable>>
-    s_cache_map;
+using CacheMap =
+    base::LruCacheMap<std::string, std::shared_ptr<Object>, IsObjectRemovable>;
+
+// objects built from directory listings, which GetPartial() can return
+using PartialMap = base::LruCacheMap<std::string, std::shared_ptr<Object>>;
+
+using PendingFetch = std::shared_future<std::shared_ptr<Object>>;
+
+struct Shard {
+  std::shared_timed_mutex mutex;
+  std::unique_ptr<CacheMap> map;
+  std::unique_ptr<MissingPaths> missing;
+  std::unique_ptr<PartialMap> partial;
+  // fetches in progress, by path, so that concurrent misses share one
+  std::map<std::string, PendingFetch> fetches;
+  // expired objects being checked in the background, by path
+  std::set<std::string> revalidating;
+  std::atomic<uint64_t> hits{0}, misses{0}, expiries{0}, coalesced{0},
+      missing_hits{0}, partial_hits{0}, stale_hits{0}, not_modified{0};
+};
+
+Shard s_shards[NUM_SHARDS];
 std::atomic_int s_get_failures(0);
-uint64_t s_hits = 0, s_misses = 0, s_expiries = 0;
+
+inline Shard *GetShard(const std::string &path) {
+  return &s_shards[std::hash<std::string>()(path) % NUM_SHARDS];
+}
+
+void RememberMissing(const std::string &path) {
+  const int expiry_in_s = base::Config::missing_path_expiry_in_s();
+  // on an eventually consistent service, a 404 may just mean that a new
+  // object hasn't shown up yet (see rename())
+  if (expiry_in_s == 0 || !services::Service::is_strongly_consistent())
+    return;
+
+  Shard *shard = GetShard(path);
+  std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+  shard->missing->Remember(path, time(nullptr) + expiry_in_s);
+  shard->partial->Erase(path);
+}
 
 int Fetch(base::Request *req, const std::string &path, CacheHints hints,
           std::shared_ptr<Object> *obj) {
-  if (!path.empty()) {
+  // an object whose changes haven't been committed is more current than
+  // anything we'd fetch
+  auto new_obj = Object::FindPendingCommit(path);
+
+  if (!new_obj && !path.empty()) {
     req->Init(base::HttpMethod::HEAD);
 
+    // versioned paths can't be directories
+    bool no_dir = Object::IsVersionedPath(path);
     if ((hints == CacheHints::NONE || hints == CacheHints::IS_DIR) &&
-        !Object::IsVersionedPath(path)) {
+        !no_dir) {
       // see if the path is a directory (trailing /) first
       req->SetUrl(Directory::BuildUrl(path));
       req->Run();
+      no_dir = (req->response_code() == base::HTTP_SC_NOT_FOUND);
     }
 
     if (hints == CacheHints::IS_FILE ||
@@ -69,14 +122,18 @@ int Fetch(base::Request *req, const std::string &path, CacheHints hints,
 
     if (req->response_code() != base::HTTP_SC_OK) {
       ++s_get_failures;
+      // only if we know there's neither a file nor a directory there
+      if (no_dir && req->response_code() == base::HTTP_SC_NOT_FOUND)
+        RememberMissing(path);
       return 0;
     }
   }
 
-  auto new_obj = Object::Create(path, req);
+  if (!new_obj) new_obj = Object::Create(path, req);
   {
-    std::lock_guard<std::mutex> lock(s_mutex);
-    auto &map_obj = (*s_cache_map)[path];
+    Shard *shard = GetShard(path);
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    auto &map_obj = (*shard->map)[path];
     if (map_obj) {
       // if the object is already in the map, don't overwrite it
       new_obj = map_obj;
@@ -84,34 +141,185 @@ int Fetch(base::Request *req, const std::string &path, CacheHints hints,
       // otherwise, save it
       map_obj = new_obj;
     }
+    shard->partial->Erase(path);
   }
   if (obj) *obj = new_obj;
 
   return 0;
 }
 
+// finishes a fetch registered in Shard::fetches, however the fetch ends: it
+// forgets the fetch, then hands its waiters the object, or an exception if
+// there's none because the fetch threw
+class FetchGuard {
+ public:
+  FetchGuard(Shard *shard, const std::string &path,
+             std::promise<std::shared_ptr<Object>> *promise)
+      : shard_(shard), path_(path), promise_(promise) {}
+
+  ~FetchGuard() {
+    {
+      std::lock_guard<std::shared_timed_mutex> lock(shard_->mutex);
+      shard_->fetches.erase(path_);
+    }
+    if (done_) {
+      promise_->set_value(obj_);
+    } else {
+      promise_->set_exception(std::make_exception_ptr(
+          std::runtime_error("failed to fetch [" + path_ + "]")));
+    }
+  }
+
+  void Finish(const std::shared_ptr<Object> &obj) {
+    obj_ = obj;
+    done_ = true;
+  }
+
+ private:
+  Shard *shard_;
+  const std::string path_;
+  std::promise<std::shared_ptr<Object>> *promise_;
+  std::shared_ptr<Object> obj_;
+  bool done_ = false;
+};
+
+// fetches the object at "path", or waits for a fetch that's already under
+// way. fetches with "req" if it's not null, or on PR_REQ_0 otherwise.
+std::shared_ptr<Object> FetchOnce(Shard *shard, const std::string &path,
+                                  CacheHints hints,
+                                  base::Request *req = nullptr) {
+  std::promise<std::shared_ptr<Object>> promise;
+  std::shared_ptr<Object> obj;
+  PendingFetch other_fetch;
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    // the fetch we missed may have just finished
+    if (shard->map->Find(path, &obj) && obj) return obj;
+
+    auto iter = shard->fetches.find(path);
+    if (iter == shard->fetches.end()) {
+      shard->fetches[path] = promise.get_future().share();
+    } else {
+      ++shard->coalesced;
+      other_fetch = iter->second;
+    }
+  }
+  if (other_fetch.valid()) return other_fetch.get();
+
+  FetchGuard guard(shard, path, &promise);
+  if (req) {
+    Fetch(req, path, hints, &obj);
+  } else {
+    threads::Pool::Call(
+        threads::PoolId::PR_REQ_0,
+        std::bind(&Fetch, std::placeholders::_1, path, hints, &obj));
+  }
+  guard.Finish(obj);
+  return obj;
+}
+
+// checks whether "obj", which has expired, has changed in the bucket. if it
+// hasn't, it's kept; otherwise it's replaced with what's there now. leaves
+// the cache alone if "obj" was replaced meanwhile.
+int Revalidate(base::Request *req, const std::shared_ptr<Object> &obj) {
+  const std::string path = obj->path();
+
+  req->Init(base::HttpMethod::HEAD);
+  req->SetUrl(obj->url());
+  if (!obj->etag().empty()) req->SetHeader("If-None-Match", obj->etag());
+  req->Run();
+
+  const int code = req->response_code();
+  std::shared_ptr<Object> new_obj;
+  if (code == base::HTTP_SC_OK) new_obj = Object::Create(path, req);
+
+  Shard *shard = GetShard(path);
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    shard->revalidating.erase(path);
+
+    std::shared_ptr<Object> current;
+    if (!shard->map->Find(path, &current) || current != obj ||
+        !obj->IsRemovable())
+      return 0;
+
+    if (code == base::HTTP_SC_NOT_MODIFIED) {
+      ++shard->not_modified;
+      obj->Refresh();
+    } else if (new_obj) {
+      (*shard->map)[path] = new_obj;
+    } else {
+      // let the next Get() sort it out
+      shard->map->Erase(path);
+    }
+  }
+  if (code == base::HTTP_SC_NOT_FOUND) RememberMissing(path);
+
+  return 0;
+}
+
+void StartRevalidation(Shard *shard, const std::shared_ptr<Object> &obj) {
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    if (!shard->revalidating.insert(obj->path()).second) return;
+  }
+  threads::Pool::CallAsync(
+      threads::PoolId::PR_REQ_1,
+      std::bind(&Revalidate, std::placeholders::_1, obj));
+}
+
 inline double Percent(uint64_t a, uint64_t b) {
   return static_cast<double>(a) / static_cast<double>(b) * 100.0;
 }
 
 void StatsWriter(std::ostream *o) {
-  uint64_t total = s_hits + s_misses + s_expiries;
+  uint64_t size = 0, hits = 0, misses = 0, expiries = 0, coalesced = 0,
+           missing_size = 0, missing_hits = 0, partial_size = 0,
+           partial_hits = 0, stale_hits = 0, not_modified = 0;
+  for (auto &shard : s_shards) {
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+      size += shard.map->size();
+      missing_size += shard.missing->size();
+      partial_size += shard.partial->size();
+    }
+    hits += shard.hits;
+    misses += shard.misses;
+    expiries += shard.expiries;
+    coalesced += shard.coalesced;
+    missing_hits += shard.missing_hits;
+    partial_hits += shard.partial_hits;
+    stale_hits += shard.stale_hits;
+    not_modified += shard.not_modified;
+  }
+
+  uint64_t total = hits + misses + expiries;
   if (total == 0) total = 1;  // avoid NaNs below
   o->setf(std::ostream::fixed);
   o->precision(2);
   *o << "object cache:\n"
         "  size: "
-     << s_cache_map->size()
+     << size
      << "\n"
         "  hits: "
-     << s_hits << " (" << Percent(s_hits, total)
+     << hits << " (" << Percent(hits, total)
      << " %)\n"
         "  misses: "
-     << s_misses << " (" << Percent(s_misses, total)
+     << misses << " (" << Percent(misses, total)
      << " %)\n"
         "  expiries: "
-     << s_expiries << " (" << Percent(s_expiries, total)
+     << expiries << " (" << Percent(expiries, total)
      << " %)\n"
+        "  hits on stale objects: "
+     << stale_hits << ", found unchanged: " << not_modified
+     << "\n"
+        "  misses that waited for another's fetch: "
+     << coalesced
+     << "\n"
+        "  paths known not to exist: "
+     << missing_size << ", lookups answered: " << missing_hits << "\n"
+        "  partial objects from listings: "
+     << partial_size << ", lookups answered: " << partial_hits << "\n"
         "  get failures: "
      << s_get_failures << "\n";
 }
@@ -120,55 +328,157 @@ base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
 }  // namespace
 
 void Cache::Init() {
-  s_cache_map.reset(new base::LruCacheMap<std::string, std::shared_ptr<Object>,
-                                          IsObjectRemovable>(
-      base::Config::max_objects_in_cache()));
+  const size_t max_objects = base::Config::max_objects_in_cache();
+  const size_t max_missing = base::Config::max_missing_paths_in_cache();
+  const size_t shard_size = (max_objects + NUM_SHARDS - 1) / NUM_SHARDS;
+  const size_t missing_shard_size = (max_missing + NUM_SHARDS - 1) / NUM_SHARDS;
+
+  for (auto &shard : s_shards) {
+    shard.map.reset(new CacheMap(shard_size));
+    shard.missing.reset(new MissingPaths(missing_shard_size));
+    shard.partial.reset(new PartialMap(shard_size));
+  }
 }
 
 std::shared_ptr<Object> Cache::Get(const std::string &path, CacheHints hints) {
+  Shard *shard = GetShard(path);
   std::shared_ptr<Object> obj;
+  bool expired = false;
   {
-    std::lock_guard<std::mutex> lock(s_mutex);
-    s_cache_map->Find(path, &obj);
-    if (!obj) {
-      ++s_misses;
-    } else if (obj->expired() && obj->IsRemovable()) {
-      ++s_expiries;
+    std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+    shard->map->Find(path, &obj);
+    if (!obj && shard->missing->IsMissing(path, time(nullptr))) {
+      ++shard->missing_hits;
+      return obj;
+    }
+    std::shared_ptr<Object> partial;
+    if (!obj && hints == CacheHints::NONE &&
+        shard->partial->Find(path, &partial)) {
+      // a listing has already told us what the object is
+      hints = (partial->type() == S_IFDIR) ? CacheHints::IS_DIR
+                                           : CacheHints::IS_FILE;
+    }
+    if (!obj)
+      ++shard->misses;
+    else if (obj->expired() && obj->IsRemovable())
+      expired = true;
+    else
+      ++shard->hits;
+  }
+  if (expired) {
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    std::shared_ptr<Object> current;
+    // someone else may have replaced it meanwhile
+    if (shard->map->Find(path, &current) && current == obj) {
+      ++shard->expiries;
+      shard->map->Erase(path);
       obj.reset();
-      s_cache_map->Erase(path);
     } else {
-      s_hits++;
+      obj = current;
+      if (obj)
+        ++shard->hits;
+      else
+        ++shard->misses;
     }
   }
-  if (!obj) {
-    threads::Pool::Call(
-        threads::PoolId::PR_REQ_0,
-        std::bind(&Fetch, std::placeholders::_1, path, hints, &obj));
-  }
+  if (!obj) obj = FetchOnce(shard, path, hints);
   return obj;
 }
 
+std::shared_ptr<Object> Cache::GetPartial(const std::string &path) {
+  Shard *shard = GetShard(path);
+  std::shared_ptr<Object> obj;
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+    if (shard->map->Find(path, &obj)) {
+      // an object that expired recently will do, while we check it for next
+      // time. the root isn't fetched, so can't be checked.
+      if (!obj->expired() || !obj->IsRemovable() || path.empty() ||
+          !obj->expired_within(base::Config::stale_while_revalidate_in_s()))
+        obj.reset();
+    } else if (shard->partial->Find(path, &obj) && !obj->expired()) {
+      // a fetched object, even an expired one, knows more than a listing
+      ++shard->partial_hits;
+      return obj;
+    } else {
+      obj.reset();
+    }
+  }
+  if (obj) {
+    ++shard->hits;
+    ++shard->stale_hits;
+    StartRevalidation(shard, obj);
+    return obj;
+  }
+  return Get(path);
+}
+
 int Cache::Preload(base::Request *req, const std::string &path,
                    CacheHints hints) {
+  Shard *shard = GetShard(path);
   {
-    std::lock_guard<std::mutex> lock(s_mutex);
-    if (s_cache_map->Find(path, nullptr)) return 0;
+    std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+    // if it's being fetched, there's no need to fetch it again
+    if (shard->map->Find(path, nullptr) || shard->fetches.count(path))
+      return 0;
   }
-  return Fetch(req, path, hints, nullptr);
+  // but misses meanwhile can wait for this fetch
+  FetchOnce(shard, path, hints, req);
+  return 0;
+}
+
+void Cache::InsertPartial(const std::shared_ptr<Object> &obj) {
+  Shard *shard = GetShard(obj->path());
+  std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+  if (shard->map->Find(obj->path(), nullptr)) return;
+  (*shard->partial)[obj->path()] = obj;
+  shard->missing->Forget(obj->path());
 }
 
 int Cache::Remove(const std::string &path) {
-  std::lock_guard<std::mutex> lock(s_mutex);
+  Shard *shard = GetShard(path);
+  std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+  shard->partial->Erase(path);
   std::shared_ptr<Object> o;
-  if (!s_cache_map->Find(path, &o)) return 0;
+  if (!shard->map->Find(path, &o)) return 0;
   if (!o->IsRemovable()) return -EBUSY;
-  s_cache_map->Erase(path);
+  shard->map->Erase(path);
+  return 0;
+}
+
+int Cache::Insert(const std::shared_ptr<Object> &obj) {
+  Shard *shard = GetShard(obj->path());
+  std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+  auto &map_obj = (*shard->map)[obj->path()];
+  // an expired object may be gone from the bucket by now
+  if (map_obj && !(map_obj->expired() && map_obj->IsRemovable()))
+    return -EEXIST;
+  map_obj = obj;
+  shard->missing->Forget(obj->path());
+  shard->partial->Erase(obj->path());
   return 0;
 }
 
+void Cache::ForgetMissing(const std::string &path, bool with_children) {
+  if (!with_children) {
+    Shard *shard = GetShard(path);
+    std::lock_guard<std::shared_timed_mutex> lock(shard->mutex);
+    shard->missing->Forget(path);
+    return;
+  }
+
+  // children are spread across the shards
+  for (auto &shard : s_shards) {
+    std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+    shard.missing->Forget(path, true);
+  }
+}
+
 void Cache::LockObject(const std::string &path,
                        const LockedObjectCallback &callback) {
-  std::unique_lock<std::mutex> lock(s_mutex, std::defer_lock);
+  Shard *shard = GetShard(path);
+  std::unique_lock<std::shared_timed_mutex> lock(shard->mutex,
+                                                 std::defer_lock);
   std::shared_ptr<Object> obj;
 
   // this puts the object at "path" in the cache if it isn't already there
@@ -184,12 +494,12 @@ void Cache::LockObject(const std::string &path,
   //   3. some other, concurrent call to Get(path) replaces the object
   //      in the cache
   //
-  // of course it's possible that s_cache_map[path] would have been pruned
-  // before we can call callback(), but then we'd be returning an empty object
-  // pointer, which callback() has to check for anyway.
+  // of course it's possible that the shard's entry for "path" would have been
+  // pruned before we can call callback(), but then we'd be returning an empty
+  // object pointer, which callback() has to check for anyway.
 
   lock.lock();
-  obj = (*s_cache_map)[path];
+  obj = (*shard->map)[path];
   callback(obj);
 }
 }  // namespace fs
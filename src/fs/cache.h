@@ -45,11 +45,31 @@ class Cache {
   static std::shared_ptr<Object> Get(const std::string &path,
                                      CacheHints hints = CacheHints::NONE);
 
+  // like Get(), but may return a partial object: one built from a directory
+  // listing (see InsertPartial()), with the right type, size and mtime but
+  // default values for everything kept in its metadata, or an object that
+  // expired within stale_while_revalidate_in_s. for callers that need no more
+  // than that.
+  static std::shared_ptr<Object> GetPartial(const std::string &path);
+
   static int Preload(base::Request *req, const std::string &path,
                      CacheHints hints = CacheHints::NONE);
 
+  // caches "obj", built from a directory listing, for GetPartial(). it's
+  // ignored once the object at its path has been fetched.
+  static void InsertPartial(const std::shared_ptr<Object> &obj);
+
   static int Remove(const std::string &path);
 
+  // caches "obj", which needn't exist in the bucket yet. fails with -EEXIST if
+  // there's already an (unexpired) object at its path.
+  static int Insert(const std::shared_ptr<Object> &obj);
+
+  // forgets that "path" (and, if "with_children", anything under it) didn't
+  // exist, once something's been created there
+  static void ForgetMissing(const std::string &path,
+                            bool with_children = false);
+
   // this method is intended to ensure that callback() is called on the one and
   // only cached object at "path"
   static void LockObject(const std::string &path,
@@ -23,6 +23,9 @@
 
 #include <atomic>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -32,6 +35,7 @@
 #include "base/statistics.h"
 #include "base/xml.h"
 #include "fs/cache.h"
+#include "fs/file.h"
 #include "fs/list_reader.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
@@ -55,15 +59,31 @@ void StatsWriter(std::ostream *o) {
      << s_delete_retries << "\n";
 }
 
+// objects that have to be copied in parts, which is left to the caller
+struct LargeObjects {
+  std::mutex mutex;
+  std::vector<std::string> names;
+};
+
+// listed object sizes, by name
+using ObjectSizes = std::map<std::string, size_t>;
+
 int CopyObject(base::Request *req, std::string *name,
                const std::string &old_base, const std::string &new_base,
-               bool is_retry) {
+               const ObjectSizes *sizes, LargeObjects *large, bool is_retry) {
   if (is_retry) ++s_copy_retries;
   const std::string old_name = old_base + *name;
   const std::string new_name = new_base + *name;
   S3_LOG(LOG_DEBUG, "Directory::CopyObject", "[%s] -> [%s]\n", old_name.c_str(),
          new_name.c_str());
-  return Object::CopyByPath(req, old_name, new_name);
+  bool is_large = false;
+  int r = Object::CopyByPath(req, old_name, new_name, sizes->at(*name),
+                             &is_large);
+  if (r == 0 && is_large) {
+    std::lock_guard<std::mutex> lock(large->mutex);
+    large->names.push_back(*name);
+  }
+  return r;
 }
 
 int DeleteObject(base::Request *req, std::string *name,
@@ -122,16 +142,21 @@ int Directory::Read(base::Request *req, const Filler &filler) {
   const size_t path_len = dir_path.size();
 
   auto reader = ListReader::Create(dir_path);
-  std::list<std::string> keys, prefixes;
+  std::list<ListEntry> entries;
+  std::list<std::string> prefixes;
   int r;
 
-  while ((r = reader->Read(req, &keys, &prefixes)) > 0) {
+  while ((r = reader->Read(req, &entries, &prefixes)) > 0) {
     for (const auto &prefix : prefixes) {
       // strip trailing slash
       std::string relative_path =
           prefix.substr(path_len, prefix.size() - path_len - 1);
       filler(relative_path);
-      if (base::Config::precache_on_readdir()) {
+      if (base::Config::stat_from_listing()) {
+        auto dir = std::make_shared<Directory>(dir_path + relative_path);
+        dir->InitFromListing(0, 0, "");
+        Cache::InsertPartial(dir);
+      } else if (base::Config::precache_on_readdir()) {
         threads::Pool::CallAsync(
             threads::PoolId::PR_REQ_1,
             std::bind(Cache::Preload, std::placeholders::_1,
@@ -139,15 +164,19 @@ int Directory::Read(base::Request *req, const Filler &filler) {
       }
     }
 
-    for (const auto &key : keys) {
-      if (dir_path == key) continue;
-      std::string relative_path = key.substr(path_len);
+    for (const auto &entry : entries) {
+      if (dir_path == entry.key) continue;
+      std::string relative_path = entry.key.substr(path_len);
       if (Object::IsInternalPath(relative_path)) {
         ++s_internal_objects_skipped_in_list;
         continue;
       }
       filler(relative_path);
-      if (base::Config::precache_on_readdir()) {
+      if (base::Config::stat_from_listing()) {
+        auto file = std::make_shared<File>(dir_path + relative_path);
+        file->InitFromListing(entry.size, entry.last_modified, entry.etag);
+        Cache::InsertPartial(file);
+      } else if (base::Config::precache_on_readdir()) {
         threads::Pool::CallAsync(
             threads::PoolId::PR_REQ_1,
             std::bind(Cache::Preload, std::placeholders::_1,
@@ -184,6 +213,13 @@ int Directory::Rename(base::Request *req, std::string to) {
   // can't do anything with the root directory
   if (path().empty()) return -EINVAL;
 
+  // so that the copies have our changes, and those of our contents (but not
+  // those of siblings that share our name as a prefix)
+  int r = FlushCommit(req);
+  if (r) return r;
+  r = Object::FlushCommits(req, path() + "/");
+  if (r) return r;
+
   to += "/";
   std::string from = path() + "/";
   const size_t from_len = from.size();
@@ -192,26 +228,34 @@ int Directory::Rename(base::Request *req, std::string to) {
   auto reader = ListReader::Create(from, false);
 
   std::list<std::string> relative_paths;
-  std::list<std::string> keys;
-  int r;
+  std::list<ListEntry> entries;
+  ObjectSizes sizes;
 
-  while ((r = reader->Read(req, &keys, nullptr)) > 0) {
-    for (const auto &key : keys) {
-      int rm_r = Cache::Remove(key);
+  while ((r = reader->Read(req, &entries, nullptr)) > 0) {
+    for (const auto &entry : entries) {
+      int rm_r = Cache::Remove(entry.key);
       if (rm_r) return rm_r;
-      relative_paths.push_back(key.substr(from_len));
+      relative_paths.push_back(entry.key.substr(from_len));
+      sizes[relative_paths.back()] = entry.size;
     }
   }
 
+  LargeObjects large;
   threads::ParallelWorkQueue<std::string> rename_queue(
       relative_paths.begin(), relative_paths.end(),
       std::bind(&CopyObject, std::placeholders::_1, std::placeholders::_2, from,
-                to, false),
+                to, &sizes, &large, false),
       std::bind(&CopyObject, std::placeholders::_1, std::placeholders::_2, from,
-                to, true));
+                to, &sizes, &large, true));
   r = rename_queue.Process();
   if (r) return r;
 
+  // these are copied in parallel parts, so one at a time will do
+  for (const auto &name : large.names) {
+    r = Object::CopyByPath(req, from + name, to + name);
+    if (r) return r;
+  }
+
   threads::ParallelWorkQueue<std::string> delete_queue(
       relative_paths.begin(), relative_paths.end(),
       std::bind(&DeleteObject, std::placeholders::_1, std::placeholders::_2,
@@ -21,9 +21,13 @@
 
 #include "fs/encrypted_file.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 
+#include "base/buffer_pool.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
@@ -47,6 +51,32 @@ const std::string META_VERIFIER = "s3fuse_enc_meta ";
 std::atomic_int s_non_empty_but_not_intact(0), s_no_iv_or_meta(0),
     s_init_errors(0), s_open_without_key(0);
 
+// like AesCtr256::EncryptWithByteOffset(), but "offset" needn't be
+// block-aligned, since data is transferred in arbitrary pieces. works in place.
+void CryptWithByteOffset(const crypto::SymmetricKey &key, off_t offset,
+                         const uint8_t *in, size_t size, uint8_t *out) {
+  constexpr size_t BLOCK_LEN = crypto::AesCtr256::BLOCK_LEN;
+  const size_t lead = offset % BLOCK_LEN;
+
+  if (lead) {
+    uint8_t block[BLOCK_LEN] = {};
+    const size_t count = std::min(size, BLOCK_LEN - lead);
+
+    memcpy(block + lead, in, count);
+    crypto::AesCtr256::EncryptWithByteOffset(key, offset - lead, block,
+                                             BLOCK_LEN, block);
+    memcpy(out, block + lead, count);
+
+    offset += count;
+    in += count;
+    out += count;
+    size -= count;
+  }
+
+  if (size)
+    crypto::AesCtr256::EncryptWithByteOffset(key, offset, in, size, out);
+}
+
 Object *Checker(const std::string &path, base::Request *req) {
   if (req->response_header("Content-Type") != CONTENT_TYPE) return nullptr;
   return new EncryptedFile(path);
@@ -161,6 +191,17 @@ void EncryptedFile::SetRequestHeaders(base::Request *req) {
   req->SetHeader(meta_prefix + Metadata::ENC_METADATA, enc_meta_);
 }
 
+void EncryptedFile::SetUploadHeaders(base::Request *req,
+                                     const std::string &sha256_hash) {
+  // our SetRequestHeaders() hides the hash, so don't let File add it back
+  SetRequestHeaders(req);
+
+  const std::string meta_prefix = services::Service::header_meta_prefix();
+  req->SetHeader(meta_prefix + Metadata::ENC_IV, meta_key_.iv().ToHexString());
+  req->SetHeader(meta_prefix + Metadata::ENC_METADATA,
+                 EncryptMetadata(sha256_hash));
+}
+
 int EncryptedFile::IsDownloadable() {
   if (!data_key_) {
     ++s_open_without_key;
@@ -171,25 +212,33 @@ int EncryptedFile::IsDownloadable() {
   return 0;
 }
 
-int EncryptedFile::ReadChunk(size_t size, off_t offset,
-                             std::vector<char> *buffer) {
-  std::vector<char> temp;
-  int r = File::ReadChunk(size, offset, &temp);
+bool EncryptedFile::CanCopyUnchangedChunks() {
+  // every upload is encrypted with a new data key
+  return false;
+}
+
+bool EncryptedFile::CanStreamUpload() {
+  // streamed parts are hashed as they're uploaded, and we hash plaintext
+  return false;
+}
+
+int EncryptedFile::ReadChunk(size_t size, off_t offset, char *buffer) {
+  int r = File::ReadChunk(size, offset, buffer);
   if (r) return r;
 
-  buffer->resize(temp.size());
-  crypto::AesCtr256::EncryptWithByteOffset(
-      data_key_, offset, reinterpret_cast<const uint8_t *>(&temp[0]),
-      temp.size(), reinterpret_cast<uint8_t *>(&(*buffer)[0]));
+  // ctr mode can encrypt in place
+  CryptWithByteOffset(data_key_, offset,
+                      reinterpret_cast<const uint8_t *>(buffer), size,
+                      reinterpret_cast<uint8_t *>(buffer));
   return 0;
 }
 
 int EncryptedFile::WriteChunk(const char *buffer, size_t size, off_t offset) {
-  std::vector<char> temp(size);
-  crypto::AesCtr256::DecryptWithByteOffset(
-      data_key_, offset, reinterpret_cast<const uint8_t *>(buffer), size,
-      reinterpret_cast<uint8_t *>(&temp[0]));
-  return File::WriteChunk(&temp[0], size, offset);
+  auto temp = base::BufferPool::Get(size);
+  CryptWithByteOffset(data_key_, offset,
+                      reinterpret_cast<const uint8_t *>(buffer), size,
+                      reinterpret_cast<uint8_t *>(temp.get()));
+  return File::WriteChunk(temp.get(), size, offset);
 }
 
 int EncryptedFile::PrepareUpload() {
@@ -207,10 +256,14 @@ int EncryptedFile::FinalizeUpload(const std::string &returned_etag) {
   int r = File::FinalizeUpload(returned_etag);
   if (r) return r;
   enc_iv_ = meta_key_.iv().ToHexString();
-  enc_meta_ = crypto::Cipher::Encrypt<crypto::AesCbc256WithPkcs, crypto::Hex>(
-      meta_key_, META_VERIFIER + data_key_.ToString() + "#" + sha256_hash());
+  enc_meta_ = EncryptMetadata(sha256_hash());
   return 0;
 }
 
+std::string EncryptedFile::EncryptMetadata(const std::string &sha256_hash) {
+  return crypto::Cipher::Encrypt<crypto::AesCbc256WithPkcs, crypto::Hex>(
+      meta_key_, META_VERIFIER + data_key_.ToString() + "#" + sha256_hash);
+}
+
 }  // namespace fs
 }  // namespace s3
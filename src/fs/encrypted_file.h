@@ -42,16 +42,22 @@ class EncryptedFile : public File {
  protected:
   void Init(base::Request *req) override;
   void SetRequestHeaders(base::Request *req) override;
+  void SetUploadHeaders(base::Request *req,
+                        const std::string &sha256_hash) override;
 
   int IsDownloadable() override;
+  bool CanCopyUnchangedChunks() override;
+  bool CanStreamUpload() override;
 
   int WriteChunk(const char *buffer, size_t size, off_t offset) override;
-  int ReadChunk(size_t size, off_t offset, std::vector<char> *buffer) override;
+  int ReadChunk(size_t size, off_t offset, char *buffer) override;
 
   int PrepareUpload() override;
   int FinalizeUpload(const std::string &returned_etag) override;
 
  private:
+  std::string EncryptMetadata(const std::string &sha256_hash);
+
   crypto::SymmetricKey meta_key_ = crypto::SymmetricKey::Empty();
   crypto::SymmetricKey data_key_ = crypto::SymmetricKey::Empty();
   std::string enc_iv_, enc_meta_;
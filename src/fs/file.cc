@@ -21,31 +21,41 @@
 
 #include "fs/file.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
+#include <map>
 #include <mutex>
 #include <string>
 #include <vector>
 
+#include "base/buffer_pool.h"
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
+#include "base/timer.h"
 #include "crypto/hash.h"
 #include "crypto/hex.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "fs/block_cache.h"
 #include "fs/cache.h"
+#include "fs/callback_xattr.h"
 #include "fs/metadata.h"
 #include "fs/mime_types.h"
+#include "fs/staging.h"
 #include "fs/static_xattr.h"
 #include "services/file_transfer.h"
 #include "services/service.h"
+#include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
 
-#define TEMP_NAME_TEMPLATE "/tmp/" PACKAGE_NAME ".local-XXXXXX"
-
 namespace s3 {
 namespace fs {
 
@@ -54,7 +64,36 @@ constexpr off_t TRUNCATE_LIMIT = 4ULL * 1024 * 1024 * 1024;  // 4 GB
 
 std::atomic_int s_sha256_mismatches(0), s_md5_mismatches(0),
     s_no_hash_checks(0);
-std::atomic_int s_non_dirty_flushes(0), s_reopens(0);
+std::atomic_int s_non_dirty_flushes(0), s_reopens(0), s_fetches_cancelled(0);
+std::atomic_int s_chunks_fetched_on_demand(0), s_reads_during_download(0);
+std::atomic_int s_chunks_read_ahead(0), s_readahead_failures(0);
+std::atomic_int s_streamed_parts(0), s_streams_completed(0),
+    s_streams_abandoned(0);
+std::atomic_int s_write_backs_queued(0), s_write_back_retries(0),
+    s_write_backs_failed(0), s_flushes_coalesced(0);
+std::atomic_int s_upload_commits(0), s_upload_commits_avoided(0);
+std::atomic_int s_remote_truncates(0), s_remote_truncate_failures(0);
+
+constexpr char WRITE_BACK_ERROR_XATTR[] = PACKAGE_NAME "_write_back_error";
+constexpr int MAX_WRITE_BACK_DELAY_IN_S = 30;
+
+// background uploads outlive the File objects that start them (a new one is
+// created once the old one expires), so their errors are kept by path until
+// the next open reports them
+std::mutex s_write_back_mutex;
+std::condition_variable s_write_back_condition;
+std::map<std::string, int> s_write_back_errors;
+int s_write_backs_pending = 0;
+
+int GetWriteBackError(const std::string &path, bool clear) {
+  std::lock_guard<std::mutex> lock(s_write_back_mutex);
+  auto iter = s_write_back_errors.find(path);
+  if (iter == s_write_back_errors.end()) return 0;
+
+  int r = iter->second;
+  if (clear) s_write_back_errors.erase(iter);
+  return r;
+}
 
 Object *Checker(const std::string &path, base::Request *req) {
   return new File(path);
@@ -70,7 +109,37 @@ void StatsWriter(std::ostream *o) {
      << s_non_dirty_flushes
      << "\n"
         "  reopens: "
-     << s_reopens << "\n";
+     << s_reopens
+     << "\n"
+        "  downloads cancelled on release: "
+     << s_fetches_cancelled
+     << "\n"
+        "  chunks fetched on demand: "
+     << s_chunks_fetched_on_demand
+     << "\n"
+        "  reads served during download: "
+     << s_reads_during_download
+     << "\n"
+        "  chunks read ahead: "
+     << s_chunks_read_ahead << ", failed: " << s_readahead_failures
+     << "\n"
+        "  parts uploaded while writing: "
+     << s_streamed_parts
+     << "\n"
+        "  streamed uploads completed: "
+     << s_streams_completed << ", abandoned: " << s_streams_abandoned
+     << "\n"
+        "  background uploads: "
+     << s_write_backs_queued << ", retries: " << s_write_back_retries
+     << ", failed: " << s_write_backs_failed
+     << ", flushes coalesced: " << s_flushes_coalesced
+     << "\n"
+        "  metadata commits after upload: "
+     << s_upload_commits << ", avoided: " << s_upload_commits_avoided
+     << "\n"
+        "  truncated on the server: "
+     << s_remote_truncates << ", failed: " << s_remote_truncate_failures
+     << "\n";
 }
 
 Object::TypeCheckers::Entry s_checker_reg(Checker, 1000);
@@ -92,21 +161,47 @@ void File::TestTransferChunkSizes() {
 }
 
 int File::Open(const std::string &path, FileOpenMode mode, uint64_t *handle) {
-  int status = -EINVAL;
+  while (true) {
+    int status = -EINVAL;
+    std::shared_ptr<File> truncating;
+
+    Cache::LockObject(path, [&status, &truncating, mode,
+                             handle](std::shared_ptr<Object> obj) {
+      if (!obj) {
+        status = -ENOENT;
+        return;
+      }
+      if (obj->type() != S_IFREG) {
+        status = -EINVAL;
+        return;
+      }
+      status = static_cast<File *>(obj.get())->Open(mode, handle);
+      if (status == -EAGAIN) truncating = std::static_pointer_cast<File>(obj);
+    });
 
-  Cache::LockObject(path, [&status, mode, handle](std::shared_ptr<Object> obj) {
-    if (!obj) {
-      status = -ENOENT;
-      return;
-    }
-    if (obj->type() != S_IFREG) {
-      status = -EINVAL;
-      return;
-    }
-    status = static_cast<File *>(obj.get())->Open(mode, handle);
-  });
+    if (!truncating) return status;
+
+    // wait without holding up the rest of the cache, then look again, since
+    // the truncated object replaces this one
+    truncating->WaitForRemoteTruncate();
+  }
+}
+
+int File::Create(const std::shared_ptr<File> &file, uint64_t *handle) {
+  int r = file->Open(FileOpenMode::CREATE, handle);
+  if (r) return r;
 
-  return status;
+  // our reference keeps the file in the cache until it's been uploaded
+  r = Cache::Insert(file);
+  if (r) {
+    {
+      // nothing's been written, so there's nothing to upload
+      std::lock_guard<std::mutex> lock(file->fs_mutex_);
+      file->status_ = 0;
+    }
+    file->Release();
+  }
+  return r;
 }
 
 File::File(const std::string &path) : Object(path) {
@@ -124,11 +219,13 @@ File::File(const std::string &path) : Object(path) {
 
 bool File::IsRemovable() {
   std::lock_guard<std::mutex> lock(fs_mutex_);
-  return ref_count_ == 0 && Object::IsRemovable();
+  // TruncateRemote() keeps us until the copy's done, as an open handle would
+  return ref_count_ == 0 && !(status_ & FS_UPLOADING) &&
+         Object::IsRemovable();
 }
 
 int File::Release() {
-  std::lock_guard<std::mutex> lock(fs_mutex_);
+  std::unique_lock<std::mutex> lock(fs_mutex_);
 
   if (ref_count_ == 0) {
     S3_LOG(LOG_WARNING, "File::Release",
@@ -137,6 +234,20 @@ int File::Release() {
     return -EINVAL;
   }
 
+  // nobody's left to read what we're fetching
+  if (ref_count_ == 1 &&
+      ((status_ & FS_DOWNLOADING) || readaheads_in_progress_)) {
+    ++s_fetches_cancelled;
+    fetch_cancel_.Cancel();
+  }
+
+  // downloads, readahead and streamed uploads use fd_, so let them finish
+  // before we close it
+  while (ref_count_ == 1 &&
+         ((status_ & FS_DOWNLOADING) || readaheads_in_progress_ ||
+          (stream_ && stream_->tasks_in_progress)))
+    condition_.wait(lock);
+
   --ref_count_;
   if (ref_count_ == 0) {
     if (status_ != 0) {
@@ -152,6 +263,33 @@ int File::Release() {
 
     close(fd_);
     fd_ = -1;
+    Staging::Resize(staged_size_, 0);
+    staged_size_ = 0;
+
+    chunk_status_.clear();
+    chunks_missing_ = 0;
+    urgent_chunks_.clear();
+    block_cache_key_.clear();
+    next_read_offset_ = 0;
+    readahead_chunks_ = 0;
+    remote_size_ = 0;
+    dirty_chunks_.clear();
+    hashes_current_ = false;
+    if (async_error_ == -ECANCELED) async_error_ = 0;
+    fetch_cancel_.Reset();
+
+    if (stream_) {
+      // never flushed, so nobody will complete it
+      if (!stream_->upload_id.empty()) {
+        ++s_streams_abandoned;
+        threads::Pool::CallAsync(
+            threads::PoolId::PR_REQ_0,
+            std::bind(&services::FileTransfer::UploadStreamAbort,
+                      services::Service::file_transfer(),
+                      std::placeholders::_1, url(), stream_->upload_id));
+      }
+      stream_.reset();
+    }
 
     Expire();
   }
@@ -159,9 +297,29 @@ int File::Release() {
   return 0;
 }
 
-int File::Flush() {
+void File::WaitForWriteBacks() {
+  std::unique_lock<std::mutex> lock(s_write_back_mutex);
+
+  if (s_write_backs_pending)
+    S3_LOG(LOG_INFO, "File::WaitForWriteBacks",
+           "waiting for %i background upload(s).\n", s_write_backs_pending);
+
+  while (s_write_backs_pending) s_write_back_condition.wait(lock);
+}
+
+int File::Flush() { return Sync(base::Config::write_back()); }
+
+int File::Fsync() { return Sync(false); }
+
+int File::Sync(bool write_back) {
   std::unique_lock<std::mutex> lock(fs_mutex_);
 
+  // everything has to be local before we can upload
+  if (!chunk_status_.empty() && (status_ & FS_DIRTY)) {
+    int r = FetchChunks(&lock, 0, remote_size_);
+    if (r) return r;
+  }
+
   while (status_ & (FS_DOWNLOADING | FS_UPLOADING | FS_WRITING))
     condition_.wait(lock);
 
@@ -171,6 +329,37 @@ int File::Flush() {
     ++s_non_dirty_flushes;
     S3_LOG(LOG_DEBUG, "File::Flush",
            "skipping flush for non-dirty file [%s].\n", path().c_str());
+    // but not changes to metadata
+    lock.unlock();
+    return FlushCommit();
+  }
+
+  if (write_back) {
+    // flushes that come in before the upload starts are folded into it, and
+    // push it back, up to max_upload_coalesce_delay_in_ms after the first
+    const double now = base::Timer::GetCurrentTime();
+    write_back_deadline_ =
+        now + base::Config::upload_coalesce_window_in_ms() / 1.0e3;
+
+    if (write_back_state_ == WB_SCHEDULED) {
+      ++s_flushes_coalesced;
+      write_back_deadline_ = std::min(write_back_deadline_, write_back_limit_);
+      return 0;
+    }
+
+    write_back_limit_ =
+        now + base::Config::max_upload_coalesce_delay_in_ms() / 1.0e3;
+    write_back_deadline_ = std::min(write_back_deadline_, write_back_limit_);
+
+    // hold a reference (and so fd_) until the upload's done
+    write_back_state_ = WB_SCHEDULED;
+    ref_count_++;
+    ++s_write_backs_queued;
+    {
+      std::lock_guard<std::mutex> wb_lock(s_write_back_mutex);
+      s_write_backs_pending++;
+    }
+    PostWriteBack();
     return 0;
   }
 
@@ -193,17 +382,39 @@ int File::Write(const char *buffer, size_t size, off_t offset) {
 
   if (read_only_) return -EROFS;
 
+  // fetch any chunks we're about to (partially) overwrite so that the rest of
+  // each chunk is intact
+  if (!chunk_status_.empty()) {
+    int r = FetchChunks(&lock, offset, size);
+    if (r) return r;
+  }
+
   while (status_ & (FS_DOWNLOADING | FS_UPLOADING)) condition_.wait(lock);
 
   if (async_error_) return async_error_;
 
+  if (offset + size > staged_size_) {
+    int r = Staging::Resize(staged_size_, offset + size);
+    if (r) return r;
+    staged_size_ = offset + size;
+  }
+
   status_ |= FS_DIRTY | FS_WRITING;
+  MarkDirty(offset, size);
 
   lock.unlock();
   int r = pwrite(fd_, buffer, size, offset);
   lock.lock();
 
   status_ &= ~FS_WRITING;
+
+  if (stream_) {
+    if (r == static_cast<int>(size))
+      UpdateStream(offset, size);
+    else
+      stream_->aborted = true;
+  }
+
   condition_.notify_all();
 
   return (r < 0) ? -errno : r;
@@ -212,7 +423,17 @@ int File::Write(const char *buffer, size_t size, off_t offset) {
 int File::Read(char *buffer, size_t size, off_t offset) {
   std::unique_lock<std::mutex> lock(fs_mutex_);
 
-  while (status_ & FS_DOWNLOADING) condition_.wait(lock);
+  // if a download is in progress, we only need to wait for the chunks we're
+  // reading
+  if (!chunk_status_.empty()) {
+    if (status_ & FS_DOWNLOADING)
+      ++s_reads_during_download;
+    else
+      ReadAhead(offset, size);
+
+    int r = FetchChunks(&lock, offset, size);
+    if (r) return r;
+  }
 
   if (async_error_) return async_error_;
 
@@ -228,14 +449,50 @@ int File::Truncate(off_t length) {
   if (length > TRUNCATE_LIMIT) return -EINVAL;
   if (read_only_) return -EROFS;
 
-  while (status_ & (FS_DOWNLOADING | FS_UPLOADING)) condition_.wait(lock);
+  // a chunk that the new end cuts short has to be here before we cut it.
+  // the chunks before it can still be fetched when they're needed.
+  const bool shrinking =
+      !chunk_status_.empty() && static_cast<size_t>(length) < remote_size_;
+  if (shrinking && length % chunk_size_) {
+    int r = FetchChunks(&lock, length, 1);
+    if (r) return r;
+  }
+
+  // the chunks past the new end must never be written, so wait for any being
+  // fetched
+  const size_t first_cut = shrinking ? (length + chunk_size_ - 1) / chunk_size_
+                                     : chunk_status_.size();
+  auto is_fetching = [this, first_cut]() {
+    return first_cut < chunk_status_.size() &&
+           std::find(chunk_status_.begin() + first_cut, chunk_status_.end(),
+                     CS_FETCHING) != chunk_status_.end();
+  };
+  while ((status_ & (FS_DOWNLOADING | FS_UPLOADING)) || is_fetching())
+    condition_.wait(lock);
 
   if (async_error_) return async_error_;
 
+  int r = Staging::Resize(staged_size_, length);
+  if (r) return r;
+  staged_size_ = length;
+
   status_ |= FS_DIRTY | FS_WRITING;
 
+  // and then count as present
+  for (size_t i = first_cut; i < chunk_status_.size(); i++) {
+    if (chunk_status_[i] == CS_PRESENT) continue;
+    chunk_status_[i] = CS_PRESENT;
+    chunks_missing_--;
+  }
+
+  // everything between the old and new ends of the file changes
+  const off_t old_length = GetLocalSize();
+  MarkDirty(std::min(old_length, length),
+            std::max(old_length, length) - std::min(old_length, length));
+  if (stream_ && old_length != length) stream_->aborted = true;
+
   lock.unlock();
-  int r = ftruncate(fd_, length);
+  r = ftruncate(fd_, length);
   lock.lock();
 
   status_ &= ~FS_WRITING;
@@ -244,6 +501,52 @@ int File::Truncate(off_t length) {
   return r;
 }
 
+int File::TruncateRemote(off_t length) {
+  const size_t threshold = base::Config::multipart_copy_threshold();
+
+  {
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+
+    // open files are truncated locally, and uploaded when they're flushed
+    if (ref_count_ || status_) return -ENOTSUP;
+    if (threshold == 0 ||
+        services::Service::file_transfer()->copy_chunk_size() == 0)
+      return -ENOTSUP;
+    if (length <= 0 || length >= stat()->st_size ||
+        static_cast<size_t>(stat()->st_size) <= threshold)
+      return -ENOTSUP;
+    if (etag().empty() || Object::IsVersionedPath(path()) ||
+        !CanCopyUnchangedChunks())
+      return -ENOTSUP;
+
+    // keeps Open() from staging the old content meanwhile
+    status_ = FS_UPLOADING;
+  }
+
+  set_ctime();
+  set_mtime();
+  const uint64_t commit_generation = this->commit_generation();
+
+  int r = threads::Pool::Call(
+      threads::PoolId::PR_REQ_0,
+      std::bind(&File::CopyPrefix, this, std::placeholders::_1, length));
+
+  {
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+    status_ = 0;
+    condition_.notify_all();
+  }
+
+  if (r) {
+    ++s_remote_truncate_failures;
+    return r;
+  }
+
+  ++s_remote_truncates;
+  CancelCommit(commit_generation);
+  return 0;
+}
+
 void File::Init(base::Request *req) {
   Object::Init(req);
 
@@ -253,6 +556,17 @@ void File::Init(base::Request *req) {
     SetSha256Hash(req->response_header(services::Service::header_meta_prefix() +
                                        Metadata::SHA256));
   }
+
+  if (base::Config::write_back()) {
+    UpdateMetadata(CallbackXAttr::Create(
+        WRITE_BACK_ERROR_XATTR,
+        [this](std::string *out) {
+          int r = GetWriteBackError(path(), false);
+          *out = r ? strerror(-r) : "";
+          return 0;
+        },
+        [](std::string) { return 0; }, XAttr::XM_VISIBLE));
+  }
 }
 
 void File::SetRequestHeaders(base::Request *req) {
@@ -261,32 +575,42 @@ void File::SetRequestHeaders(base::Request *req) {
                  sha256_hash_);
 }
 
+void File::SetUploadHeaders(base::Request *req,
+                            const std::string &sha256_hash) {
+  SetRequestHeaders(req);
+  req->SetHeader(services::Service::header_meta_prefix() + Metadata::SHA256,
+                 sha256_hash);
+}
+
 void File::UpdateStat() {
   Object::UpdateStat();
   {
-    std::lock_guard<std::mutex> lock(fs_mutex_);
+    std::unique_lock<std::mutex> lock(fs_mutex_);
     UpdateStat(lock);
   }
 }
 
+bool File::IsUploadPending() {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+  // an upload that's already started has its metadata
+  return (status_ & FS_DIRTY) && !(status_ & FS_UPLOADING);
+}
+
 int File::IsDownloadable() { return 0; }
 
+bool File::CanStreamUpload() { return true; }
+
+bool File::CanCopyUnchangedChunks() { return true; }
+
 int File::WriteChunk(const char *buffer, size_t size, off_t offset) {
   ssize_t r = pwrite(fd_, buffer, size, offset);
   if (r != static_cast<ssize_t>(size)) return -errno;
-  if (hash_list_)
-    hash_list_->ComputeHash(offset, reinterpret_cast<const uint8_t *>(buffer),
-                            size);
   return 0;
 }
 
-int File::ReadChunk(size_t size, off_t offset, std::vector<char> *buffer) {
-  buffer->resize(size);
-  ssize_t r = pread(fd_, &(*buffer)[0], size, offset);
+int File::ReadChunk(size_t size, off_t offset, char *buffer) {
+  ssize_t r = pread(fd_, buffer, size, offset);
   if (r != static_cast<ssize_t>(size)) return -errno;
-  if (hash_list_)
-    hash_list_->ComputeHash(
-        offset, reinterpret_cast<const uint8_t *>(&(*buffer)[0]), size);
   return 0;
 }
 
@@ -306,6 +630,7 @@ int File::FinalizeDownload() {
              sha256_hash_.c_str(), computed_hash.c_str());
       return -EIO;
     }
+    hashes_current_ = true;
   } else if (crypto::Md5::IsValidQuotedHexHash(etag())) {
     // as a fallback, use the etag as an md5 hash of the file
     std::string computed_hash =
@@ -326,7 +651,36 @@ int File::FinalizeDownload() {
 }
 
 int File::PrepareUpload() {
-  hash_list_.reset(new crypto::HashList<crypto::Sha256>(GetLocalSize()));
+  const size_t size = GetLocalSize();
+  const size_t chunk_size = crypto::HashList<crypto::Sha256>::CHUNK_SIZE;
+  std::vector<bool> dirty_chunks;
+  bool hashes_current;
+
+  {
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+
+    // chunks we haven't touched keep their hashes; the rest are recomputed
+    // here, since uploads read the file in pieces that don't line up with
+    // hash list chunks
+    hashes_current = hash_list_ && hashes_current_;
+    if (hashes_current) {
+      hash_list_->Resize(size);
+      dirty_chunks = dirty_chunks_;
+    } else {
+      hash_list_.reset(new crypto::HashList<crypto::Sha256>(size));
+      hashes_current_ = false;
+    }
+  }
+
+  if (!hashes_current) return HashChunk(size, 0);
+
+  for (size_t i = 0; i < dirty_chunks.size() && i * chunk_size < size; i++) {
+    if (!dirty_chunks[i]) continue;
+    int r = HashChunk(std::min(chunk_size, size - i * chunk_size),
+                      i * chunk_size);
+    if (r) return r;
+  }
+
   return 0;
 }
 
@@ -344,45 +698,107 @@ void File::SetSha256Hash(const std::string &hash) {
 }
 
 int File::Open(FileOpenMode mode, uint64_t *handle) {
-  std::lock_guard<std::mutex> lock(fs_mutex_);
+  std::unique_lock<std::mutex> lock(fs_mutex_);
+
+  // the caller waits out a server-side truncate (see TruncateRemote())
+  if (ref_count_ == 0 && (status_ & FS_UPLOADING)) return -EAGAIN;
+
+  // report failed background uploads once
+  int r = GetWriteBackError(path(), true);
+  if (r) return r;
 
   if (ref_count_ == 0) {
-    char temp_name[] = TEMP_NAME_TEMPLATE;
-    const off_t size = stat()->st_size;
+    r = OpenLocal(mode);
+    if (r) {
+      // don't leave a half-opened file behind
+      if (fd_ != -1) close(fd_);
+      fd_ = -1;
+      Staging::Resize(staged_size_, 0);
+      staged_size_ = 0;
+      return r;
+    }
+  } else {
+    ++s_reopens;
+  }
 
-    fd_ = mkstemp(temp_name);
-    unlink(temp_name);
+  *handle = reinterpret_cast<uint64_t>(this);
+  ref_count_++;
+
+  return 0;
+}
+
+void File::WaitForRemoteTruncate() {
+  std::unique_lock<std::mutex> lock(fs_mutex_);
+  while (ref_count_ == 0 && (status_ & FS_UPLOADING)) condition_.wait(lock);
+}
 
-    S3_LOG(LOG_DEBUG, "File::Open", "opening [%s] in [%s].\n", path().c_str(),
-           temp_name);
+int File::OpenLocal(FileOpenMode mode) {
+  const off_t size = stat()->st_size;
+  const size_t staged_size = (mode == FileOpenMode::DEFAULT) ? size : 0;
 
-    if (fd_ == -1) return -errno;
+  int r = Staging::Resize(0, staged_size);
+  if (r) return r;
+  staged_size_ = staged_size;
 
-    if (Object::IsVersionedPath(path())) read_only_ = true;
+  S3_LOG(LOG_DEBUG, "File::Open", "opening [%s].\n", path().c_str());
 
-    if (mode == FileOpenMode::TRUNCATE_TO_ZERO) {
-      if (read_only_) return -EROFS;
-      // if the file had a non-zero size but was opened with O_TRUNC, we need
-      // to write back a zero-length file.
-      if (size) status_ = FS_DIRTY;
-    } else {
-      if (ftruncate(fd_, size) != 0) return -errno;
-      if (size > 0) {
-        int r = IsDownloadable();
+  fd_ = Staging::Create(staged_size);
+  if (fd_ < 0) {
+    r = fd_;
+    fd_ = -1;
+    return r;
+  }
+
+  if (Object::IsVersionedPath(path())) read_only_ = true;
+
+  if (mode == FileOpenMode::CREATE) {
+    if (read_only_) return -EROFS;
+    // the first flush creates the object, even if it's empty
+    status_ = FS_DIRTY;
+  } else if (mode == FileOpenMode::TRUNCATE_TO_ZERO) {
+    if (read_only_) return -EROFS;
+    // if the file had a non-zero size but was opened with O_TRUNC, we need
+    // to write back a zero-length file.
+    if (size) status_ = FS_DIRTY;
+  } else {
+    if (ftruncate(fd_, size) != 0) return -errno;
+    if (size > 0) {
+      int r = IsDownloadable();
+      if (r) return r;
+
+      remote_size_ = size;
+      chunk_size_ = services::Service::file_transfer()->download_chunk_size();
+      if (chunk_size_ == 0) chunk_size_ = size;
+      chunks_missing_ = (size + chunk_size_ - 1) / chunk_size_;
+      block_cache_key_ = BlockCache::GetKey(path(), etag(), chunk_size_);
+
+      if (base::Config::download_on_demand()) {
+        r = PrepareDownload();
         if (r) return r;
+        chunk_status_.assign(chunks_missing_, CS_MISSING);
+      } else {
+        // every chunk belongs to the download we're about to start
+        chunk_status_.assign(chunks_missing_, CS_FETCHING);
         status_ = FS_DOWNLOADING;
         threads::Pool::Post(
             threads::PoolId::PR_0,
             std::bind(&File::Download, this, std::placeholders::_1),
-            std::bind(&File::OnDownloadComplete, this, std::placeholders::_1));
+            std::bind(&File::OnDownloadComplete, this,
+                      std::placeholders::_1));
       }
     }
-  } else {
-    ++s_reopens;
   }
 
-  *handle = reinterpret_cast<uint64_t>(this);
-  ref_count_++;
+  const size_t part_size =
+      services::Service::file_transfer()->upload_chunk_size();
+
+  if (base::Config::stream_uploads() && !read_only_ && part_size > 0 &&
+      GetLocalSize() == 0 && CanStreamUpload()) {
+    stream_.reset(new UploadStream());
+    stream_->part_size = part_size;
+    // streamed parts keep their own hashes
+    hash_list_.reset();
+  }
 
   return 0;
 }
@@ -393,11 +809,17 @@ int File::Download(base::Request * /* ignored */) {
 
   r = services::Service::file_transfer()->Download(
       url(), GetLocalSize(),
-      std::bind(&File::WriteChunk, this, std::placeholders::_1,
-                std::placeholders::_2, std::placeholders::_3));
+      std::bind(&File::WriteDownloadedChunk, this, std::placeholders::_1,
+                std::placeholders::_2, std::placeholders::_3),
+      std::bind(&File::GetUrgentChunk, this),
+      std::bind(&File::LoadCachedChunk, this, std::placeholders::_1,
+                std::placeholders::_2),
+      &fetch_cancel_);
   if (r) return r;
 
-  return FinalizeDownload();
+  r = FinalizeDownload();
+  if (r && !block_cache_key_.empty()) BlockCache::Erase(block_cache_key_);
+  return r;
 }
 
 void File::OnDownloadComplete(int ret) {
@@ -412,21 +834,657 @@ void File::OnDownloadComplete(int ret) {
 
   async_error_ = ret;
   status_ = 0;
+  chunk_status_.clear();
+  chunks_missing_ = 0;
+  urgent_chunks_.clear();
   condition_.notify_all();
 }
 
-int File::Upload(base::Request * /* ignored */) {
-  int r = PrepareUpload();
+int File::WriteDownloadedChunk(const char *buffer, size_t size, off_t offset) {
+  int r = WriteChunk(buffer, size, offset);
   if (r) return r;
-  std::string returned_etag;
-  r = services::Service::file_transfer()->Upload(
-      url(), GetLocalSize(),
-      std::bind(&File::ReadChunk, this, std::placeholders::_1,
+
+  // pieces of a chunk arrive in order, so the chunk is complete once we've
+  // seen its last byte
+  const off_t start = offset / chunk_size_ * chunk_size_;
+  const size_t chunk_size = std::min(chunk_size_, remote_size_ - start);
+  if (offset + size != start + chunk_size) return 0;
+
+  r = HashChunk(chunk_size, start);
+  if (r) return r;
+
+  if (!block_cache_key_.empty()) {
+    // ReadChunk() gives us the chunk as it's stored remotely
+    auto chunk = base::BufferPool::Get(chunk_size);
+    r = ReadChunk(chunk_size, start, chunk.get());
+    if (r) return r;
+    BlockCache::Put(block_cache_key_, start / chunk_size_, chunk.get(),
+                    chunk_size);
+  }
+
+  MarkChunksPresent(chunk_size, start);
+  return 0;
+}
+
+int File::HashChunk(size_t size, off_t offset) {
+  return hash_list_ ? HashLocal(hash_list_.get(), 0, size, offset) : 0;
+}
+
+int File::HashLocal(crypto::HashList<crypto::Sha256> *hashes, off_t base,
+                    size_t size, off_t offset) {
+  const size_t hash_chunk_size = crypto::HashList<crypto::Sha256>::CHUNK_SIZE;
+  auto buffer = base::BufferPool::Get(std::min(size, hash_chunk_size));
+
+  for (size_t o = 0; o < size; o += hash_chunk_size) {
+    const size_t piece = std::min(size - o, hash_chunk_size);
+    ssize_t r = pread(fd_, buffer.get(), piece, offset + o);
+    if (r != static_cast<ssize_t>(piece)) return -errno;
+    hashes->ComputeHash(offset + o - base,
+                        reinterpret_cast<const uint8_t *>(buffer.get()),
+                        piece);
+  }
+
+  return 0;
+}
+
+bool File::LoadCachedChunk(size_t size, off_t offset) {
+  if (block_cache_key_.empty() || offset % chunk_size_ != 0) return false;
+
+  auto buffer = base::BufferPool::Get(size);
+  if (!BlockCache::Get(block_cache_key_, offset / chunk_size_, size,
+                       buffer.get()))
+    return false;
+
+  // on failure, fall back to downloading the chunk
+  if (WriteChunk(buffer.get(), size, offset) || HashChunk(size, offset))
+    return false;
+
+  MarkChunksPresent(size, offset);
+  return true;
+}
+
+void File::MarkChunksPresent(size_t size, off_t offset) {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+  const size_t end = (offset + size + chunk_size_ - 1) / chunk_size_;
+
+  for (size_t i = offset / chunk_size_; i < std::min(end, chunk_status_.size());
+       i++) {
+    if (chunk_status_[i] == CS_PRESENT) continue;
+    chunk_status_[i] = CS_PRESENT;
+    chunks_missing_--;
+  }
+
+  condition_.notify_all();
+}
+
+off_t File::GetUrgentChunk() {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+
+  while (!urgent_chunks_.empty()) {
+    size_t i = urgent_chunks_.front();
+    urgent_chunks_.pop_front();
+
+    if (i < chunk_status_.size() && chunk_status_[i] != CS_PRESENT)
+      return i * chunk_size_;
+  }
+
+  return -1;
+}
+
+int File::FetchChunks(std::unique_lock<std::mutex> *lock, off_t offset,
+                      size_t size) {
+  while (!chunk_status_.empty()) {
+    if (async_error_) return async_error_;
+    if (size == 0 || offset >= static_cast<off_t>(remote_size_)) return 0;
+
+    const size_t end = std::min(offset + size, remote_size_);
+    const size_t first = offset / chunk_size_;
+    const size_t last = (end - 1) / chunk_size_;
+    std::vector<ChunkRange> ranges;
+    bool pending = false;
+
+    for (size_t i = first; i <= last; i++) {
+      if (chunk_status_[i] == CS_FETCHING) pending = true;
+      if (chunk_status_[i] != CS_MISSING) continue;
+
+      ChunkRange range;
+      range.offset = i * chunk_size_;
+      range.size = std::min(chunk_size_, remote_size_ - range.offset);
+      ranges.push_back(range);
+      chunk_status_[i] = CS_FETCHING;
+    }
+
+    if (ranges.empty()) {
+      // nothing left for us to fetch, but someone else might be fetching
+      // chunks we need
+      if (!pending) return 0;
+
+      // if that someone is the download started at open, have it fetch our
+      // chunks next
+      if (status_ & FS_DOWNLOADING) {
+        for (size_t i = first; i <= last; i++) {
+          if (chunk_status_[i] == CS_FETCHING &&
+              std::find(urgent_chunks_.begin(), urgent_chunks_.end(), i) ==
+                  urgent_chunks_.end())
+            urgent_chunks_.push_back(i);
+        }
+      }
+
+      condition_.wait(*lock);
+      continue;
+    }
+
+    lock->unlock();
+    threads::ParallelWorkQueue<ChunkRange> fetch(
+        ranges.begin(), ranges.end(),
+        std::bind(&File::FetchChunk, this, std::placeholders::_1,
+                  std::placeholders::_2),
+        std::bind(&File::FetchChunk, this, std::placeholders::_1,
+                  std::placeholders::_2));
+    int r = fetch.Process();
+    lock->lock();
+
+    if (r) {
+      // chunks that made it are kept; the rest can be tried again
+      for (const auto &range : ranges) {
+        uint8_t *status = &chunk_status_[range.offset / chunk_size_];
+        if (*status == CS_FETCHING) *status = CS_MISSING;
+      }
+    } else {
+      s_chunks_fetched_on_demand += ranges.size();
+      r = FinishFetching();
+    }
+
+    condition_.notify_all();
+    if (r) return r;
+  }
+
+  // if the download started at open failed, it'll have cleared chunk_status_
+  return async_error_;
+}
+
+int File::FetchChunk(base::Request *req, ChunkRange *range) {
+  if (LoadCachedChunk(range->size, range->offset)) return 0;
+
+  return services::Service::file_transfer()->DownloadChunk(
+      req, url(), range->size, range->offset,
+      std::bind(&File::WriteDownloadedChunk, this, std::placeholders::_1,
                 std::placeholders::_2, std::placeholders::_3),
-      &returned_etag);
+      &fetch_cancel_);
+}
+
+int File::FinishFetching() {
+  if (chunks_missing_ > 0 || chunk_status_.empty() ||
+      (status_ & FS_DOWNLOADING))
+    return 0;
+
+  // the whole file is now local, so from here on we behave as though it had
+  // been downloaded on open.
+  chunk_status_.clear();
+
+  // if we've written to the file then FinalizeDownload() won't see what was
+  // downloaded
+  if (!(status_ & FS_DIRTY)) {
+    async_error_ = FinalizeDownload();
+    if (async_error_ && !block_cache_key_.empty())
+      BlockCache::Erase(block_cache_key_);
+  }
+
+  return async_error_;
+}
+
+void File::ReadAhead(off_t offset, size_t size) {
+  const size_t max_chunks = base::Config::max_readahead_chunks();
+
+  // double the window for each sequential read, and drop it entirely as soon
+  // as we see a random one
+  if (offset == next_read_offset_)
+    readahead_chunks_ = std::min(std::max<size_t>(readahead_chunks_ * 2, 1),
+                                 max_chunks);
+  else
+    readahead_chunks_ = 0;
+
+  next_read_offset_ = offset + size;
+
+  const size_t first = next_read_offset_ / chunk_size_;
+  const size_t last =
+      std::min(first + readahead_chunks_, chunk_status_.size());
+
+  for (size_t i = first; i < last; i++) {
+    if (chunk_status_[i] != CS_MISSING) continue;
+
+    chunk_status_[i] = CS_FETCHING;
+    readaheads_in_progress_++;
+
+    threads::Pool::Post(
+        threads::PoolId::PR_REQ_1,
+        std::bind(&File::ReadAheadChunk, this, std::placeholders::_1, i),
+        std::bind(&File::OnReadAheadComplete, this, i, std::placeholders::_1));
+  }
+}
+
+int File::ReadAheadChunk(base::Request *req, size_t index) {
+  ChunkRange range;
+  range.offset = index * chunk_size_;
+  range.size = std::min(chunk_size_, remote_size_ - range.offset);
+  return FetchChunk(req, &range);
+}
+
+void File::OnReadAheadComplete(size_t index, int ret) {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+
+  if (ret) {
+    ++s_readahead_failures;
+    // leave it for a reader to fetch (and report errors for), and back off
+    if (index < chunk_status_.size() && chunk_status_[index] == CS_FETCHING)
+      chunk_status_[index] = CS_MISSING;
+    readahead_chunks_ /= 2;
+  } else {
+    ++s_chunks_read_ahead;
+    FinishFetching();
+  }
+
+  readaheads_in_progress_--;
+  condition_.notify_all();
+}
+
+int File::Upload(base::Request * /* ignored */) {
+  // deferred changes made before now will go with the upload
+  const uint64_t commit_generation = this->commit_generation();
+  std::string returned_etag, headers_etag;
+  bool streamed = false;
+  int r = FinishStream(&returned_etag, &streamed);
   if (r) return r;
+
+  if (!streamed) {
+    r = PrepareUpload();
+    if (r) return r;
+
+    // the hashes are complete, so the metadata can go up with the content
+    const std::string sha256_hash = hash_list_->GetRootHash<crypto::Hex>();
+    r = services::Service::file_transfer()->Upload(
+        url(), GetLocalSize(),
+        std::bind(&File::ReadChunk, this, std::placeholders::_1,
+                  std::placeholders::_2, std::placeholders::_3),
+        &returned_etag, CanCopyUnchangedChunks() ? etag() : "",
+        std::bind(&File::IsChunkUnchanged, this, std::placeholders::_1,
+                  std::placeholders::_2),
+        [this, &sha256_hash, &headers_etag](base::Request *req,
+                                            const std::string &etag) {
+          SetUploadHeaders(req, sha256_hash);
+          // so that Object::Init() finds the object intact
+          req->SetHeader(services::Service::header_meta_prefix() +
+                             Metadata::LAST_UPDATE_ETAG,
+                         etag);
+          headers_etag = etag;
+        });
+    if (r) return r;
+  }
+
   r = FinalizeUpload(returned_etag);
-  return r ? r : Commit();
+  if (r) return r;
+
+  {
+    // the object now matches the local file
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+    dirty_chunks_.clear();
+    remote_size_ = GetLocalSize();
+    hashes_current_ = true;
+  }
+
+  // streamed uploads begin before the metadata is final, and the service may
+  // not have given the object the etag we predicted; otherwise the metadata
+  // is already in place
+  if (!headers_etag.empty() && returned_etag == headers_etag) {
+    ++s_upload_commits_avoided;
+  } else {
+    ++s_upload_commits;
+    r = Commit();
+    if (r) return r;
+  }
+
+  CancelCommit(commit_generation);
+  return 0;
+}
+
+int File::CopyPrefix(base::Request *req, off_t length) {
+  std::string new_etag;
+  int r = services::Service::file_transfer()->CopyMulti(
+      req, url(), url(), length, etag(),
+      [this](base::Request *init_req, const std::string &) {
+        const std::string meta_prefix =
+            services::Service::header_meta_prefix();
+        SetRequestHeaders(init_req);
+        // we'd have to read the whole file to hash it
+        init_req->SetHeader(meta_prefix + Metadata::SHA256, "");
+      },
+      &new_etag);
+  if (r) return r;
+
+  set_etag(new_etag);
+  stat()->st_size = length;
+  SetSha256Hash("");
+
+  // the copy has a new etag, but still carries the old one as its last update
+  // etag. committing again makes it intact.
+  r = Commit(req);
+  if (r) return r;
+
+  // so that the next lookup gets the rest of the new object's attributes
+  Expire();
+  return 0;
+}
+
+void File::PostWriteBack() {
+  threads::Pool::CallAsyncAt(
+      threads::PoolId::PR_0, write_back_deadline_,
+      std::bind(&File::OnWriteBackDue, this, std::placeholders::_1));
+}
+
+int File::OnWriteBackDue(base::Request *) {
+  {
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+    // pushed back by flushes since this was posted
+    if (base::Timer::GetCurrentTime() < write_back_deadline_) {
+      PostWriteBack();
+      return 0;
+    }
+  }
+  threads::Pool::Post(
+      threads::PoolId::PR_0,
+      std::bind(&File::WriteBack, this, std::placeholders::_1),
+      std::bind(&File::OnWriteBackComplete, this, std::placeholders::_1));
+  return 0;
+}
+
+int File::WriteBack(base::Request *req) {
+  int r = 0;
+
+  {
+    std::unique_lock<std::mutex> lock(fs_mutex_);
+
+    while (status_ & (FS_DOWNLOADING | FS_UPLOADING | FS_WRITING))
+      condition_.wait(lock);
+
+    // an fsync may have beaten us to it
+    if (!(status_ & FS_DIRTY)) {
+      write_back_state_ = WB_IDLE;
+      return 0;
+    }
+
+    write_back_state_ = WB_UPLOADING;
+    status_ |= FS_UPLOADING;
+  }
+
+  for (int i = 0; i <= base::Config::max_write_back_retries(); i++) {
+    if (i > 0) {
+      ++s_write_back_retries;
+      S3_LOG(LOG_WARNING, "File::WriteBack",
+             "retrying upload of [%s] after error %i.\n", path().c_str(), r);
+      base::Timer::Sleep(std::min(1 << (i - 1), MAX_WRITE_BACK_DELAY_IN_S));
+    }
+
+    r = Upload(req);
+    if (r == 0) break;
+  }
+
+  return r;
+}
+
+void File::OnWriteBackComplete(int ret) {
+  // Release() may let the cache replace (and destroy) us
+  const std::string file_path = path();
+
+  {
+    std::lock_guard<std::mutex> lock(fs_mutex_);
+
+    // if the file's still open, the next flush can try again. otherwise the
+    // data is gone, and all we can do is report the error.
+    if (write_back_state_ == WB_UPLOADING)
+      status_ = (ret && ref_count_ > 1) ? FS_DIRTY : 0;
+    write_back_state_ = WB_IDLE;
+    condition_.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(s_write_back_mutex);
+    if (ret) {
+      ++s_write_backs_failed;
+      S3_LOG(LOG_ERR, "File::OnWriteBackComplete",
+             "background upload of [%s] failed with error %i.\n",
+             file_path.c_str(), ret);
+      s_write_back_errors[file_path] = ret;
+    } else {
+      s_write_back_errors.erase(file_path);
+    }
+  }
+
+  // drop the reference taken in Sync()
+  Release();
+
+  std::lock_guard<std::mutex> lock(s_write_back_mutex);
+  s_write_backs_pending--;
+  s_write_back_condition.notify_all();
+}
+
+void File::UpdateStream(off_t offset, size_t size) {
+  UploadStream *stream = stream_.get();
+  if (stream->aborted) return;
+
+  if (offset < static_cast<off_t>(stream->parts.size() * stream->part_size)) {
+    // we've already sent this part, so we'll have to upload the whole file
+    stream->aborted = true;
+    return;
+  }
+
+  const off_t end = offset + size;
+
+  if (offset <= stream->written) {
+    stream->written = std::max(stream->written, end);
+  } else {
+    off_t *pending_end = &stream->pending[offset];
+    *pending_end = std::max(*pending_end, end);
+  }
+
+  // writes can arrive out of order, so pick up anything that's now contiguous
+  for (auto iter = stream->pending.begin();
+       iter != stream->pending.end() && iter->first <= stream->written;
+       iter = stream->pending.erase(iter))
+    stream->written = std::max(stream->written, iter->second);
+
+  PostStreamParts();
+}
+
+void File::PostStreamParts() {
+  UploadStream *stream = stream_.get();
+  if (stream->aborted) return;
+
+  if (stream->upload_id.empty()) {
+    if (stream->beginning ||
+        stream->written < static_cast<off_t>(stream->part_size))
+      return;
+
+    auto upload_id = std::make_shared<std::string>();
+
+    stream->beginning = true;
+    stream->tasks_in_progress++;
+
+    threads::Pool::Post(
+        threads::PoolId::PR_REQ_0,
+        std::bind(&services::FileTransfer::UploadStreamBegin,
+                  services::Service::file_transfer(), std::placeholders::_1,
+                  url(), upload_id.get()),
+        std::bind(&File::OnStreamBeginComplete, this, upload_id,
+                  std::placeholders::_1));
+    return;
+  }
+
+  // the last part goes out when we're flushed, since it may not be full-sized
+  while (static_cast<off_t>((stream->parts.size() + 1) * stream->part_size) <=
+         stream->written) {
+    auto part = std::make_shared<StreamPart>();
+
+    part->id = stream->parts.size();
+    part->size = stream->part_size;
+    part->offset = part->id * stream->part_size;
+
+    stream->parts.push_back(part);
+    stream->tasks_in_progress++;
+
+    threads::Pool::Post(
+        threads::PoolId::PR_REQ_1,
+        std::bind(&File::UploadStreamPart, this, std::placeholders::_1,
+                  stream->upload_id, part),
+        std::bind(&File::OnStreamPartComplete, this, std::placeholders::_1));
+  }
+}
+
+void File::OnStreamBeginComplete(std::shared_ptr<std::string> upload_id,
+                                 int ret) {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+  UploadStream *stream = stream_.get();
+
+  stream->beginning = false;
+  stream->tasks_in_progress--;
+
+  if (ret) {
+    S3_LOG(LOG_DEBUG, "File::OnStreamBeginComplete",
+           "not streaming upload of [%s]: %i.\n", path().c_str(), ret);
+    stream->aborted = true;
+  } else {
+    stream->upload_id = *upload_id;
+    PostStreamParts();
+  }
+
+  condition_.notify_all();
+}
+
+int File::UploadStreamPart(base::Request *req, const std::string &upload_id,
+                           std::shared_ptr<StreamPart> part) {
+  part->hashes.reset(new crypto::HashList<crypto::Sha256>(part->size));
+
+  int r = HashLocal(part->hashes.get(), part->offset, part->size, part->offset);
+  if (r) return r;
+
+  for (int i = 0; i <= base::Config::max_transfer_retries(); i++) {
+    r = services::Service::file_transfer()->UploadStreamPart(
+        req, url(), upload_id, part->id, part->size, part->offset,
+        std::bind(&File::ReadChunk, this, std::placeholders::_1,
+                  std::placeholders::_2, std::placeholders::_3),
+        &part->etag);
+    if (r != -EAGAIN && r != -ETIMEDOUT) break;
+  }
+
+  return r;
+}
+
+void File::OnStreamPartComplete(int ret) {
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+
+  stream_->tasks_in_progress--;
+  if (ret)
+    stream_->aborted = true;
+  else
+    ++s_streamed_parts;
+
+  condition_.notify_all();
+}
+
+int File::FinishStream(std::string *returned_etag, bool *finished) {
+  std::unique_ptr<UploadStream> stream;
+  size_t size = 0;
+
+  *finished = false;
+
+  {
+    std::unique_lock<std::mutex> lock(fs_mutex_);
+    if (!stream_) return 0;
+
+    while (stream_->tasks_in_progress) condition_.wait(lock);
+
+    // one shot: anything written after this flush is uploaded the usual way
+    stream = std::move(stream_);
+    size = GetLocalSize();
+  }
+
+  if (stream->upload_id.empty()) return 0;
+
+  auto *transfer = services::Service::file_transfer();
+  int r = -EIO;
+
+  if (!stream->aborted && stream->pending.empty() &&
+      stream->written == static_cast<off_t>(size)) {
+    const off_t sent = stream->parts.size() * stream->part_size;
+    r = 0;
+
+    if (static_cast<off_t>(size) > sent) {
+      auto part = std::make_shared<StreamPart>();
+
+      part->id = stream->parts.size();
+      part->size = size - sent;
+      part->offset = sent;
+
+      stream->parts.push_back(part);
+      r = threads::Pool::Call(
+          threads::PoolId::PR_REQ_1,
+          std::bind(&File::UploadStreamPart, this, std::placeholders::_1,
+                    stream->upload_id, part));
+    }
+
+    if (r == 0) {
+      std::vector<std::string> part_etags;
+      for (const auto &part : stream->parts) part_etags.push_back(part->etag);
+
+      r = threads::Pool::Call(
+          threads::PoolId::PR_REQ_0,
+          std::bind(&services::FileTransfer::UploadStreamEnd, transfer,
+                    std::placeholders::_1, url(), stream->upload_id,
+                    part_etags, returned_etag));
+    }
+  }
+
+  if (r) {
+    // fall back to uploading everything
+    ++s_streams_abandoned;
+    threads::Pool::Call(
+        threads::PoolId::PR_REQ_0,
+        std::bind(&services::FileTransfer::UploadStreamAbort, transfer,
+                  std::placeholders::_1, url(), stream->upload_id));
+    return 0;
+  }
+
+  hash_list_.reset(new crypto::HashList<crypto::Sha256>(size));
+  for (const auto &part : stream->parts)
+    hash_list_->Import(part->offset, *part->hashes);
+
+  ++s_streams_completed;
+  *finished = true;
+  return 0;
+}
+
+void File::MarkDirty(off_t offset, size_t size) {
+  const size_t chunk_size = crypto::HashList<crypto::Sha256>::CHUNK_SIZE;
+  if (size == 0) return;
+
+  const size_t last = (offset + size - 1) / chunk_size;
+  if (dirty_chunks_.size() <= last) dirty_chunks_.resize(last + 1);
+
+  for (size_t i = offset / chunk_size; i <= last; i++) dirty_chunks_[i] = true;
+}
+
+bool File::IsChunkUnchanged(size_t size, off_t offset) {
+  const size_t chunk_size = crypto::HashList<crypto::Sha256>::CHUNK_SIZE;
+  std::lock_guard<std::mutex> lock(fs_mutex_);
+
+  if (size == 0 || offset + size > remote_size_) return false;
+
+  // PrepareUpload() has already hashed the chunk
+  const size_t last =
+      std::min((offset + size - 1) / chunk_size + 1, dirty_chunks_.size());
+  for (size_t i = offset / chunk_size; i < last; i++)
+    if (dirty_chunks_[i]) return false;
+
+  return true;
 }
 
 size_t File::GetLocalSize() {
@@ -439,7 +1497,7 @@ size_t File::GetLocalSize() {
   return s.st_size;
 }
 
-void File::UpdateStat(const std::lock_guard<std::mutex> &) {
+void File::UpdateStat(const std::unique_lock<std::mutex> &) {
   if (fd_ != -1) stat()->st_size = GetLocalSize();
 }
 
@@ -24,11 +24,14 @@
 
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
+#include "base/cancel_token.h"
 #include "base/request.h"
 #include "crypto/hash_list.h"
 #include "crypto/sha256.h"
@@ -36,7 +39,7 @@
 
 namespace s3 {
 namespace fs {
-enum class FileOpenMode { DEFAULT, TRUNCATE_TO_ZERO };
+enum class FileOpenMode { DEFAULT, TRUNCATE_TO_ZERO, CREATE };
 
 class File : public Object {
  public:
@@ -47,6 +50,12 @@ class File : public Object {
   static void TestTransferChunkSizes();
 
   static int Open(const std::string &path, FileOpenMode mode, uint64_t *handle);
+  // opens and caches "file", which is new. it's only created in the bucket
+  // (with its content and metadata) when it's first flushed.
+  static int Create(const std::shared_ptr<File> &file, uint64_t *handle);
+
+  // blocks until background uploads (see write_back) have finished
+  static void WaitForWriteBacks();
 
   explicit File(const std::string &path);
   ~File() override = default;
@@ -55,19 +64,35 @@ class File : public Object {
 
   int Release();
   int Flush();
+  int Fsync();
   int Write(const char *buffer, size_t size, off_t offset);
   int Read(char *buffer, size_t size, off_t offset);
   int Truncate(off_t length);
+  // shrinks the file by copying what's left of it on the server, without
+  // opening it. returns -ENOTSUP if the file's open, or isn't large enough
+  // (see multipart_copy_threshold) for this to be worth it.
+  int TruncateRemote(off_t length);
 
  protected:
   void Init(base::Request *req) override;
   void SetRequestHeaders(base::Request *req) override;
   void UpdateStat() override;
+  bool IsUploadPending() override;
+
+  // SetRequestHeaders(), for an upload of content with hash "sha256_hash"
+  virtual void SetUploadHeaders(base::Request *req,
+                                const std::string &sha256_hash);
 
   virtual int IsDownloadable();
 
+  // whether unchanged parts of the remote object can be reused on upload
+  virtual bool CanCopyUnchangedChunks();
+
+  // whether parts can be uploaded while the file is still being written
+  virtual bool CanStreamUpload();
+
   virtual int WriteChunk(const char *buffer, size_t size, off_t offset);
-  virtual int ReadChunk(size_t size, off_t offset, std::vector<char> *buffer);
+  virtual int ReadChunk(size_t size, off_t offset, char *buffer);
 
   virtual int PrepareDownload();
   virtual int FinalizeDownload();
@@ -86,15 +111,89 @@ class File : public Object {
     FS_DIRTY = 0x8
   };
 
+  enum ChunkStatus : uint8_t { CS_MISSING = 0, CS_FETCHING, CS_PRESENT };
+
+  enum WriteBackState { WB_IDLE, WB_SCHEDULED, WB_UPLOADING };
+
+  struct ChunkRange {
+    size_t size;
+    off_t offset;
+  };
+
+  struct StreamPart {
+    int id;
+    size_t size;
+    off_t offset;
+    std::string etag;
+    std::unique_ptr<crypto::HashList<crypto::Sha256>> hashes;
+  };
+
+  struct UploadStream {
+    std::string upload_id;
+    size_t part_size = 0;
+    off_t written = 0;  // bytes written contiguously from the start of the file
+    std::map<off_t, off_t> pending;  // ranges written past "written"
+    std::vector<std::shared_ptr<StreamPart>> parts;
+    size_t tasks_in_progress = 0;
+    bool beginning = false, aborted = false;
+  };
+
+  // returns -EAGAIN while TruncateRemote() is copying
   int Open(FileOpenMode mode, uint64_t *handle);
+  void WaitForRemoteTruncate();
+  int OpenLocal(FileOpenMode mode);  // call with lock held
 
   int Download(base::Request *);
   void OnDownloadComplete(int ret);
+  int WriteDownloadedChunk(const char *buffer, size_t size, off_t offset);
+  int HashChunk(size_t size, off_t offset);
+  // hashes the local file's [offset, offset + size) into "hashes", which
+  // starts at "base"
+  int HashLocal(crypto::HashList<crypto::Sha256> *hashes, off_t base,
+                size_t size, off_t offset);
+  bool LoadCachedChunk(size_t size, off_t offset);
+  void MarkChunksPresent(size_t size, off_t offset);
+  off_t GetUrgentChunk();
   int Upload(base::Request *);
+  int CopyPrefix(base::Request *req, off_t length);
+
+  int Sync(bool write_back);
+  // posts OnWriteBackDue() for write_back_deadline_. call with lock held.
+  void PostWriteBack();
+  int OnWriteBackDue(base::Request *);
+  int WriteBack(base::Request *req);
+  void OnWriteBackComplete(int ret);
+
+  // call with lock held
+  void UpdateStream(off_t offset, size_t size);
+  void PostStreamParts();
+
+  void OnStreamBeginComplete(std::shared_ptr<std::string> upload_id, int ret);
+  int UploadStreamPart(base::Request *req, const std::string &upload_id,
+                       std::shared_ptr<StreamPart> part);
+  void OnStreamPartComplete(int ret);
+  int FinishStream(std::string *returned_etag, bool *finished);
+
+  // ensures that [offset, offset + size) is in the local file, either by
+  // fetching it (with download_on_demand) or by waiting for the download
+  // started at open to write it. call with lock held.
+  int FetchChunks(std::unique_lock<std::mutex> *lock, off_t offset,
+                  size_t size);
+  int FetchChunk(base::Request *req, ChunkRange *range);
+  int FinishFetching();
+
+  void MarkDirty(off_t offset, size_t size);  // call with lock held
+  bool IsChunkUnchanged(size_t size, off_t offset);
+
+  // tracks sequential reads and fetches chunks ahead of them. call with lock
+  // held.
+  void ReadAhead(off_t offset, size_t size);
+  int ReadAheadChunk(base::Request *req, size_t index);
+  void OnReadAheadComplete(size_t index, int ret);
 
   size_t GetLocalSize();
 
-  void UpdateStat(const std::lock_guard<std::mutex> &);
+  void UpdateStat(const std::unique_lock<std::mutex> &);
 
   std::mutex fs_mutex_;
   std::condition_variable condition_;
@@ -105,6 +204,38 @@ class File : public Object {
   int fd_ = -1, status_ = 0, async_error_ = 0;
   bool read_only_ = false;
   uint64_t ref_count_ = 0;
+  size_t staged_size_ = 0;  // space accounted to us by Staging
+
+  // protected by fs_mutex_; empty unless downloading or fetching on demand
+  std::vector<uint8_t> chunk_status_;
+  size_t chunk_size_ = 0, chunks_missing_ = 0, remote_size_ = 0;
+  std::deque<size_t> urgent_chunks_;
+
+  // protected by fs_mutex_
+  off_t next_read_offset_ = 0;
+  size_t readahead_chunks_ = 0, readaheads_in_progress_ = 0;
+
+  // protected by fs_mutex_; in hash list chunks, relative to the object at
+  // etag() (which is remote_size_ bytes long). hashes_current_ is true if
+  // hash_list_ holds the hashes of every chunk that isn't dirty.
+  std::vector<bool> dirty_chunks_;
+  bool hashes_current_ = false;
+
+  // protected by fs_mutex_; null unless streaming uploads
+  std::unique_ptr<UploadStream> stream_;
+
+  // protected by fs_mutex_; a scheduled background upload starts once
+  // write_back_deadline_ passes, which flushes push back up to
+  // write_back_limit_
+  WriteBackState write_back_state_ = WB_IDLE;
+  double write_back_deadline_ = 0.0, write_back_limit_ = 0.0;
+
+  // cancelled when the last handle is released, to stop fetching content
+  // nobody will read
+  base::CancelToken fetch_cancel_;
+
+  // set at open; empty unless the block cache is enabled
+  std::string block_cache_key_;
 };
 }  // namespace fs
 }  // namespace s3
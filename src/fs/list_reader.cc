@@ -22,7 +22,12 @@
 #include "fs/list_reader.h"
 
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include <cstdlib>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -37,13 +42,50 @@ namespace fs {
 
 namespace {
 constexpr char IS_TRUNCATED_XPATH[] = "/ListBucketResult/IsTruncated";
-constexpr char KEY_XPATH[] = "/ListBucketResult/Contents/Key";
+constexpr char CONTENTS_XPATH[] = "/ListBucketResult/Contents";
 constexpr char NEXT_MARKER_XPATH[] = "/ListBucketResult/NextMarker";
 constexpr char NEXT_CONTINUATION_TOKEN_XPATH[] =
     "/ListBucketResult/NextContinuationToken";
 constexpr char PREFIX_XPATH[] = "/ListBucketResult/CommonPrefixes/Prefix";
 }  // namespace
 
+time_t ListReader::ParseTime(const std::string &str) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(str.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+             &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    return 0;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+int ListReader::FindEntries(base::XmlDocument *doc,
+                            std::list<ListEntry> *entries) {
+  std::list<std::map<std::string, std::string>> contents;
+  int r = doc->Find(CONTENTS_XPATH, &contents);
+  if (r) return r;
+  for (auto &fields : contents) {
+    ListEntry entry;
+    entry.key = fields["Key"];
+    entry.size = strtoull(fields["Size"].c_str(), nullptr, 0);
+    entry.etag = fields["ETag"];
+    entry.last_modified = ParseTime(fields["LastModified"]);
+    entries->push_back(entry);
+  }
+  return 0;
+}
+
+int ListReader::Read(base::Request *req, std::list<std::string> *keys,
+                     std::list<std::string> *prefixes) {
+  if (!keys) return -EINVAL;
+  keys->clear();
+  std::list<ListEntry> entries;
+  int r = Read(req, &entries, prefixes);
+  for (const auto &entry : entries) keys->push_back(entry.key);
+  return r;
+}
+
 class ListReaderV1 : public ListReader {
  public:
   ListReaderV1(const std::string &prefix, bool group_common_prefixes = true,
@@ -52,7 +94,7 @@ class ListReaderV1 : public ListReader {
         group_common_prefixes_(group_common_prefixes),
         max_keys_(max_keys) {}
 
-  int Read(base::Request *req, std::list<std::string> *keys,
+  int Read(base::Request *req, std::list<ListEntry> *entries,
            std::list<std::string> *prefixes) override;
 
  private:
@@ -63,10 +105,10 @@ class ListReaderV1 : public ListReader {
   bool truncated_ = true;
 };
 
-int ListReaderV1::Read(base::Request *req, std::list<std::string> *keys,
+int ListReaderV1::Read(base::Request *req, std::list<ListEntry> *entries,
                        std::list<std::string> *prefixes) {
-  if (!keys) return -EINVAL;
-  keys->clear();
+  if (!entries) return -EINVAL;
+  entries->clear();
   if (prefixes) prefixes->clear();
 
   if (!truncated_) return 0;
@@ -99,7 +141,7 @@ int ListReaderV1::Read(base::Request *req, std::list<std::string> *keys,
     if (r) return r;
   }
 
-  r = doc->Find(KEY_XPATH, keys);
+  r = FindEntries(doc.get(), entries);
   if (r) return r;
 
   if (truncated_) {
@@ -109,11 +151,11 @@ int ListReaderV1::Read(base::Request *req, std::list<std::string> *keys,
       r = doc->Find(NEXT_MARKER_XPATH, &marker_);
       if (r) return r;
     } else {
-      marker_ = keys->back();
+      marker_ = entries->back().key;
     }
   }
 
-  return keys->size() + (prefixes ? prefixes->size() : 0);
+  return entries->size() + (prefixes ? prefixes->size() : 0);
 }
 
 class ListReaderV2 : public ListReader {
@@ -124,7 +166,7 @@ class ListReaderV2 : public ListReader {
         group_common_prefixes_(group_common_prefixes),
         max_keys_(max_keys) {}
 
-  int Read(base::Request *req, std::list<std::string> *keys,
+  int Read(base::Request *req, std::list<ListEntry> *entries,
            std::list<std::string> *prefixes) override;
 
  private:
@@ -135,10 +177,10 @@ class ListReaderV2 : public ListReader {
   bool truncated_ = true;
 };
 
-int ListReaderV2::Read(base::Request *req, std::list<std::string> *keys,
+int ListReaderV2::Read(base::Request *req, std::list<ListEntry> *entries,
                        std::list<std::string> *prefixes) {
-  if (!keys) return -EINVAL;
-  keys->clear();
+  if (!entries) return -EINVAL;
+  entries->clear();
   if (prefixes) prefixes->clear();
 
   if (!truncated_) return 0;
@@ -176,7 +218,7 @@ int ListReaderV2::Read(base::Request *req, std::list<std::string> *keys,
     if (r) return r;
   }
 
-  r = doc->Find(KEY_XPATH, keys);
+  r = FindEntries(doc.get(), entries);
   if (r) return r;
 
   if (truncated_) {
@@ -186,7 +228,7 @@ int ListReaderV2::Read(base::Request *req, std::list<std::string> *keys,
     if (r) return r;
   }
 
-  return keys->size() + (prefixes ? prefixes->size() : 0);
+  return entries->size() + (prefixes ? prefixes->size() : 0);
 }
 
 std::unique_ptr<ListReader> ListReader::Create(const std::string &prefix,
@@ -22,6 +22,9 @@
 #ifndef S3_FS_LIST_READER_H
 #define S3_FS_LIST_READER_H
 
+#include <time.h>
+
+#include <cstddef>
 #include <list>
 #include <memory>
 #include <string>
@@ -29,17 +32,40 @@
 namespace s3 {
 namespace base {
 class Request;
+class XmlDocument;
 };
 
 namespace fs {
+// what a listing says about an object, besides its key
+struct ListEntry {
+  std::string key;
+  size_t size = 0;
+  std::string etag;
+  time_t last_modified = 0;
+};
+
 class ListReader {
  public:
   static std::unique_ptr<ListReader> Create(const std::string &prefix,
                                             bool group_common_prefixes = true,
                                             int max_keys = -1);
 
-  virtual int Read(base::Request *req, std::list<std::string> *keys,
+  // parses ISO 8601 times like "2009-10-12T17:50:30.000Z" (always UTC).
+  // returns 0 if "str" isn't one.
+  static time_t ParseTime(const std::string &str);
+
+  // appends the objects in the ListBucketResult "doc" to "entries"
+  static int FindEntries(base::XmlDocument *doc,
+                         std::list<ListEntry> *entries);
+
+  virtual ~ListReader() = default;
+
+  virtual int Read(base::Request *req, std::list<ListEntry> *entries,
                    std::list<std::string> *prefixes) = 0;
+
+  // like the above, for callers that only need keys
+  int Read(base::Request *req, std::list<std::string> *keys,
+           std::list<std::string> *prefixes);
 };
 }  // namespace fs
 }  // namespace s3
@@ -0,0 +1,53 @@
+/*
+ * fs/missing_paths.cc
+ * -------------------------------------------------------------------------
+ * Missing path memory implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fs/missing_paths.h"
+
+#include <string>
+#include <vector>
+
+namespace s3 {
+namespace fs {
+void MissingPaths::Remember(const std::string &path, time_t until) {
+  paths_[path] = until;
+}
+
+bool MissingPaths::IsMissing(const std::string &path, time_t now) {
+  time_t until = 0;
+  return paths_.Find(path, &until) && now < until;
+}
+
+void MissingPaths::Forget(const std::string &path, bool with_children) {
+  paths_.Erase(path);
+  if (!with_children) return;
+
+  // the slash keeps siblings like "path2/x" out
+  const std::string prefix = path + "/";
+  std::vector<std::string> children;
+  paths_.ForEachNewest(
+      [&prefix, &children](const std::string &key, const time_t &) {
+        if (key.compare(0, prefix.size(), prefix) == 0)
+          children.push_back(key);
+      });
+  for (const auto &child : children) paths_.Erase(child);
+}
+}  // namespace fs
+}  // namespace s3
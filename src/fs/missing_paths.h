@@ -0,0 +1,56 @@
+/*
+ * fs/missing_paths.h
+ * -------------------------------------------------------------------------
+ * Remembers paths that don't exist, for a while.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_MISSING_PATHS_H
+#define S3_FS_MISSING_PATHS_H
+
+#include <time.h>
+
+#include <string>
+
+#include "base/lru_cache_map.h"
+
+namespace s3 {
+namespace fs {
+// not thread-safe: callers lock around it
+class MissingPaths {
+ public:
+  // remembers at most "max_size" paths, dropping the least recently noted
+  inline explicit MissingPaths(size_t max_size) : paths_(max_size) {}
+
+  // notes that "path" doesn't exist, and that this holds until "until"
+  void Remember(const std::string &path, time_t until);
+
+  // returns true if "path" is known not to exist at "now"
+  bool IsMissing(const std::string &path, time_t now);
+
+  // forgets "path" and, if "with_children", anything under "path/"
+  void Forget(const std::string &path, bool with_children = false);
+
+  inline size_t size() { return paths_.size(); }
+
+ private:
+  base::LruCacheMap<std::string, time_t> paths_;
+};
+}  // namespace fs
+}  // namespace s3
+
+#endif
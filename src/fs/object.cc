@@ -24,9 +24,14 @@
 #include <string.h>
 #include <sys/xattr.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <list>
 #include <map>
+#include <mutex>
 #include <string>
 
 #include "base/config.h"
@@ -40,6 +45,7 @@
 #include "fs/callback_xattr.h"
 #include "fs/metadata.h"
 #include "fs/static_xattr.h"
+#include "services/file_transfer.h"
 #include "services/service.h"
 #include "threads/pool.h"
 
@@ -97,6 +103,13 @@ constexpr char VERSION_SEPARATOR = '#';
 std::atomic_int s_precon_failed_commits(0), s_new_etag_on_commit(0);
 std::atomic_int s_commit_failures(0), s_precon_rescues(0),
     s_abandoned_commits(0);
+std::atomic_int s_commits_deferred(0), s_commits_coalesced(0),
+    s_commits_flushed(0), s_commits_skipped(0), s_deferred_commit_failures(0);
+
+// objects with deferred commits, by path. the cache hands these out rather
+// than fetching them again until they've been committed.
+std::mutex s_commit_mutex;
+std::map<std::string, std::shared_ptr<Object>> s_pending_commits;
 
 void StatsWriter(std::ostream *o) {
   *o << "objects:\n"
@@ -113,7 +126,13 @@ void StatsWriter(std::ostream *o) {
      << s_precon_rescues
      << "\n"
         "  abandoned commits: "
-     << s_abandoned_commits << "\n";
+     << s_abandoned_commits
+     << "\n"
+        "  deferred commits: "
+     << s_commits_deferred << ", coalesced: " << s_commits_coalesced
+     << ", flushed early: " << s_commits_flushed
+     << ", left to uploads: " << s_commits_skipped
+     << ", failed: " << s_deferred_commit_failures << "\n";
 }
 
 inline std::string BuildUrlNoInternalCheck(const std::string &path) {
@@ -129,6 +148,65 @@ inline std::string BuildUrlForVersionedPath(const std::string &path) {
   return services::Service::versioning()->BuildVersionedUrl(base_path, version);
 }
 
+bool CanCopyInParts() {
+  return base::Config::multipart_copy_threshold() > 0 &&
+         services::Service::file_transfer()->copy_chunk_size() > 0;
+}
+
+// true if objects of "size" bytes are copied in parts
+bool IsLargeCopy(size_t size) {
+  return CanCopyInParts() && size > base::Config::multipart_copy_threshold();
+}
+
+// metadata isn't carried over by copies made in parts, so "req" gets the
+// source's (from "headers")
+void SetCopiedHeaders(base::Request *req, const base::HeaderMap &headers) {
+  const std::string meta_prefix = services::Service::header_meta_prefix();
+
+  for (const auto &header : headers) {
+    if (header.first.compare(0, meta_prefix.size(), meta_prefix) == 0 ||
+        header.first == "Content-Type" || header.first == "Cache-Control")
+      req->SetHeader(header.first, header.second);
+  }
+}
+
+// copies "from_url" (of "size" bytes, with "source_etag") to "to_url" in
+// parts. a copy made in parts gets a new etag, so if "last_update_etag" says
+// the source was intact, the copy is copied onto itself with the new etag as
+// its last update etag. the parts are the same, so this ends once the etag
+// stops changing. "set_headers" sets the metadata, given the last update etag.
+int CopyInParts(
+    base::Request *req, const std::string &from_url, const std::string &to_url,
+    size_t size, const std::string &source_etag,
+    const std::string &last_update_etag,
+    const std::function<void(base::Request *, const std::string &)>
+        &set_headers,
+    std::string *etag) {
+  std::string copy_from = from_url, if_match = source_etag,
+              last_update = last_update_etag;
+
+  for (int i = 0; i < base::Config::max_inconsistent_state_retries(); i++) {
+    int r = services::Service::file_transfer()->CopyMulti(
+        req, copy_from, to_url, size, if_match,
+        [&set_headers, &last_update](base::Request *init_req,
+                                     const std::string &) {
+          set_headers(init_req, last_update);
+        },
+        etag);
+    if (r) return r;
+    if (last_update != if_match || *etag == last_update) return 0;
+
+    ++s_new_etag_on_commit;
+    copy_from = to_url;
+    if_match = *etag;
+    last_update = *etag;
+  }
+
+  S3_LOG(LOG_WARNING, "CopyInParts", "etag of [%s] didn't settle.\n",
+         to_url.c_str());
+  return 0;
+}
+
 base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
 }  // namespace
 
@@ -162,11 +240,50 @@ bool Object::IsVersionedPath(const std::string &path) {
 }
 
 int Object::CopyByPath(base::Request *req, const std::string &from,
-                       const std::string &to) {
+                       const std::string &to, ssize_t size, bool *is_large) {
+  const std::string from_url = Object::BuildUrl(from);
+  const std::string to_url = Object::BuildUrl(to);
+
+  if (CanCopyInParts() && (size < 0 || IsLargeCopy(size))) {
+    if (size >= 0 && is_large) {
+      *is_large = true;
+      return 0;
+    }
+
+    // we need the size to decide, and the metadata to copy in parts
+    req->Init(base::HttpMethod::HEAD);
+    req->SetUrl(from_url);
+    req->Run();
+    if (req->response_code() != base::HTTP_SC_OK) return -EIO;
+
+    size = strtoull(req->response_header("Content-Length").c_str(), nullptr, 0);
+
+    if (IsLargeCopy(size)) {
+      if (is_large) {
+        *is_large = true;
+        return 0;
+      }
+
+      const base::HeaderMap headers = req->response_headers();
+      const std::string meta_prefix = services::Service::header_meta_prefix();
+      std::string etag;
+      return CopyInParts(
+          req, from_url, to_url, size, req->response_header("ETag"),
+          req->response_header(meta_prefix + Metadata::LAST_UPDATE_ETAG),
+          [&headers, &meta_prefix](base::Request *r,
+                                   const std::string &last_update) {
+            SetCopiedHeaders(r, headers);
+            r->SetHeader(meta_prefix + Metadata::LAST_UPDATE_ETAG,
+                         last_update);
+          },
+          &etag);
+    }
+  }
+
   req->Init(base::HttpMethod::PUT);
-  req->SetUrl(Object::BuildUrl(to));
+  req->SetUrl(to_url);
   req->SetHeader(services::Service::header_prefix() + "copy-source",
-                 Object::BuildUrl(from));
+                 from_url);
   req->SetHeader(services::Service::header_prefix() + "metadata-directive",
                  "COPY");
   // use transfer timeout because this could take a while
@@ -194,19 +311,57 @@ std::shared_ptr<Object> Object::Create(const std::string &path,
   return obj;
 }
 
+std::shared_ptr<Object> Object::FindPendingCommit(const std::string &path) {
+  std::lock_guard<std::mutex> lock(s_commit_mutex);
+  auto iter = s_pending_commits.find(path);
+  return (iter == s_pending_commits.end()) ? nullptr : iter->second;
+}
+
+int Object::FlushCommits(base::Request *req, const std::string &prefix) {
+  std::vector<std::shared_ptr<Object>> objects;
+
+  {
+    std::lock_guard<std::mutex> lock(s_commit_mutex);
+    for (auto iter = s_pending_commits.lower_bound(prefix);
+         iter != s_pending_commits.end() &&
+         iter->first.compare(0, prefix.size(), prefix) == 0;) {
+      objects.push_back(iter->second);
+      iter = s_pending_commits.erase(iter);
+    }
+  }
+
+  int r = 0;
+  for (const auto &obj : objects) {
+    ++s_commits_flushed;
+    int commit_r = obj->Commit(req);
+    if (commit_r && !r) r = commit_r;
+  }
+  return r;
+}
+
+int Object::FlushCommits() {
+  return threads::Pool::Call(
+      threads::PoolId::PR_REQ_0,
+      [](base::Request *r) { return FlushCommits(r, ""); });
+}
+
 Object::~Object() {}
 
 bool Object::IsRemovable() { return true; }
 
 int Object::Remove(base::Request *req) {
   if (!IsRemovable()) return -EBUSY;
+  CancelCommit(commit_generation());
   Cache::Remove(path_);
   return Object::RemoveByUrl(req, url_);
 }
 
 int Object::Rename(base::Request *req, std::string to) {
   if (!IsRemovable()) return -EBUSY;
-  int r = Object::CopyByPath(req, path_, to);
+  // so that the copy has our changes
+  int r = FlushCommit(req);
+  if (r) return r;
+  r = Object::CopyByPath(req, path_, to, stat_.st_size);
   if (r) return r;
   Cache::Remove(path_);
   return Remove(req);
@@ -278,10 +433,21 @@ void Object::SetMode(mode_t mode) {
 int Object::Commit(base::Request *req) {
   int current_error = 0, last_error = 0;
 
+  // objects too large to copy in one request are copied in parts. this isn't
+  // retried, since the copy itself is.
+  if (!etag_.empty() && IsLargeCopy(stat_.st_size)) {
+    int r = CommitInParts(req);
+    if (r != -EAGAIN) return r;
+  }
+
   // we may need to try to commit several times because:
   //
   // 1. the etag can change as a result of a copy
   // 2. we may get intermittent "precondition failed" errors
+  //
+  // the second doesn't apply if the service is strongly consistent: a failed
+  // precondition means the object really did change.
+  const bool strong = services::Service::is_strongly_consistent();
 
   for (int i = 0; i < base::Config::max_inconsistent_state_retries(); i++) {
     // save error from last iteration (so that we can tell if the precondition
@@ -311,8 +477,9 @@ int Object::Commit(base::Request *req) {
       ++s_precon_failed_commits;
       S3_LOG(LOG_WARNING, "Object::Commit",
              "got precondition failed error for [%s].\n", url_.c_str());
-      base::Timer::Sleep(i + 1);
       current_error = -EBUSY;
+      if (strong) break;
+      base::Timer::Sleep(i + 1);
       continue;
     }
 
@@ -379,11 +546,178 @@ int Object::Commit(base::Request *req) {
   return current_error;
 }
 
+int Object::CommitInParts(base::Request *req) {
+  // stat_ may describe local changes that haven't been uploaded yet, so get
+  // the size of what's actually there
+  req->Init(base::HttpMethod::HEAD);
+  req->SetUrl(url_);
+  req->Run();
+  if (req->response_code() != base::HTTP_SC_OK) {
+    ++s_commit_failures;
+    return -EIO;
+  }
+
+  if (req->response_header("ETag") != etag_) {
+    ++s_precon_failed_commits;
+    ++s_abandoned_commits;
+    return -EBUSY;
+  }
+
+  const size_t size =
+      strtoull(req->response_header("Content-Length").c_str(), nullptr, 0);
+  if (!IsLargeCopy(size)) return -EAGAIN;
+
+  std::string new_etag;
+  int r = CopyInParts(
+      req, url_, url_, size, etag_, etag_,
+      [this](base::Request *init_req, const std::string &last_update) {
+        SetRequestHeaders(init_req);
+        init_req->SetHeader(services::Service::header_meta_prefix() +
+                                Metadata::LAST_UPDATE_ETAG,
+                            last_update);
+      },
+      &new_etag);
+  if (r) {
+    ++s_commit_failures;
+    return r;
+  }
+
+  etag_ = new_etag;
+  return 0;
+}
+
 int Object::Commit() {
   return threads::Pool::Call(threads::PoolId::PR_REQ_0,
                              [this](base::Request *r) { return Commit(r); });
 }
 
+int Object::DeferCommit() {
+  return ScheduleCommit(base::Config::metadata_commit_delay_in_ms(), true);
+}
+
+int Object::CommitWithin(int delay_in_ms) {
+  return ScheduleCommit(delay_in_ms, false);
+}
+
+int Object::ScheduleCommit(int delay_in_ms, bool push_back) {
+  if (delay_in_ms == 0) return Commit();
+
+  std::lock_guard<std::mutex> lock(s_commit_mutex);
+  const double deadline = base::Timer::GetCurrentTime() + delay_in_ms / 1.0e3;
+  commit_generation_++;
+
+  auto &pending = s_pending_commits[path_];
+  if (pending.get() == this) {
+    ++s_commits_coalesced;
+    if (push_back) {
+      commit_deadline_ = deadline;
+    } else if (deadline < commit_deadline_) {
+      // the posted commit is too late now. a commit that's running reposts
+      // itself for these changes anyway.
+      commit_deadline_ = deadline;
+      if (!committing_) PostDeferredCommit();
+    }
+    return 0;
+  }
+
+  commit_deadline_ = deadline;
+  pending = shared_from_this();
+  ++s_commits_deferred;
+  PostDeferredCommit();
+  return 0;
+}
+
+void Object::PostDeferredCommit() {
+  auto obj = shared_from_this();
+  const uint64_t post = ++commit_post_;
+  threads::Pool::CallAsyncAt(
+      threads::PoolId::PR_REQ_0, commit_deadline_,
+      [obj, post](base::Request *r) {
+        return obj->RunDeferredCommit(r, post);
+      });
+}
+
+int Object::RunDeferredCommit(base::Request *req, uint64_t post) {
+  std::unique_lock<std::mutex> lock(s_commit_mutex);
+  auto is_pending = [this]() {
+    auto iter = s_pending_commits.find(path_);
+    return iter != s_pending_commits.end() && iter->second.get() == this;
+  };
+
+  // flushed, cancelled, or replaced by a later post
+  if (!is_pending() || post != commit_post_) return 0;
+
+  // pushed back by changes since this was posted
+  if (base::Timer::GetCurrentTime() < commit_deadline_) {
+    PostDeferredCommit();
+    return 0;
+  }
+
+  if (IsUploadPending()) {
+    ++s_commits_skipped;
+    s_pending_commits.erase(path_);
+    return 0;
+  }
+
+  const uint64_t generation = commit_generation_;
+  committing_ = true;
+  lock.unlock();
+  int r = Commit(req);
+  lock.lock();
+  committing_ = false;
+
+  if (!is_pending()) return r;
+  // go around again if there were changes while we were committing
+  if (r == 0 && commit_generation_ != generation) {
+    PostDeferredCommit();
+    return 0;
+  }
+
+  if (r) {
+    ++s_deferred_commit_failures;
+    S3_LOG(LOG_WARNING, "Object::RunDeferredCommit",
+           "failed to commit [%s] with error %i.\n", path_.c_str(), r);
+  }
+  s_pending_commits.erase(path_);
+  return r;
+}
+
+int Object::FlushCommit(base::Request *req) {
+  {
+    std::lock_guard<std::mutex> lock(s_commit_mutex);
+    auto iter = s_pending_commits.find(path_);
+    if (iter == s_pending_commits.end() || iter->second.get() != this)
+      return 0;
+    s_pending_commits.erase(iter);
+  }
+
+  ++s_commits_flushed;
+  return Commit(req);
+}
+
+int Object::FlushCommit() {
+  // don't bother with a request if there's nothing to commit
+  if (FindPendingCommit(path_).get() != this) return 0;
+  return threads::Pool::Call(
+      threads::PoolId::PR_REQ_0,
+      [this](base::Request *r) { return FlushCommit(r); });
+}
+
+uint64_t Object::commit_generation() {
+  std::lock_guard<std::mutex> lock(s_commit_mutex);
+  return commit_generation_;
+}
+
+void Object::CancelCommit(uint64_t generation) {
+  std::lock_guard<std::mutex> lock(s_commit_mutex);
+  auto iter = s_pending_commits.find(path_);
+  if (iter == s_pending_commits.end() || iter->second.get() != this ||
+      commit_generation_ != generation)
+    return;
+  ++s_commits_skipped;
+  s_pending_commits.erase(iter);
+}
+
 int Object::Remove() {
   return threads::Pool::Call(threads::PoolId::PR_REQ_0,
                              [this](base::Request *r) { return Remove(r); });
@@ -561,8 +895,26 @@ void Object::SetRequestHeaders(base::Request *req) {
 
 void Object::SetRequestBody(base::Request *req) {}
 
+void Object::InitFromListing(size_t size, time_t mtime,
+                             const std::string &etag) {
+  etag_ = etag;
+  stat_.st_size = size;
+  stat_.st_blocks = (stat_.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (mtime) {
+    stat_.st_ctime = mtime;
+    stat_.st_mtime = mtime;
+  }
+  expiry_ = time(nullptr) + base::Config::cache_expiry_in_s();
+}
+
+void Object::Refresh() {
+  if (expiry_) expiry_ = time(nullptr) + base::Config::cache_expiry_in_s();
+}
+
 void Object::UpdateStat() {}
 
+bool Object::IsUploadPending() { return false; }
+
 Object::MetadataMap::iterator Object::UpdateMetadata(
     std::unique_ptr<XAttr> attr) {
   return metadata_.insert(std::make_pair(attr->key(), std::move(attr))).first;
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
@@ -47,7 +48,7 @@ namespace fs {
 class Glacier;
 #endif
 
-class Object {
+class Object : public std::enable_shared_from_this<Object> {
  public:
   using TypeChecker =
       std::function<Object *(const std::string &path, base::Request *req)>;
@@ -62,12 +63,24 @@ class Object {
   static bool IsVersionedPath(const std::string &path);
 
   static int RemoveByUrl(base::Request *req, const std::string &url);
+  // objects larger than multipart_copy_threshold are copied in parts, on
+  // PR_REQ_1. callers on PR_REQ_1 (which can't wait for that) pass
+  // "is_large", which is set instead of copying such objects. callers that
+  // know the object's size pass it, to save a HEAD for small objects.
   static int CopyByPath(base::Request *req, const std::string &from,
-                        const std::string &to);
+                        const std::string &to, ssize_t size = -1,
+                        bool *is_large = nullptr);
 
   static std::shared_ptr<Object> Create(const std::string &path,
                                         base::Request *req);
 
+  // returns the object at "path" if it has a deferred commit (see
+  // DeferCommit()), since it's more current than what's in the bucket
+  static std::shared_ptr<Object> FindPendingCommit(const std::string &path);
+  // commits deferred changes to objects whose paths start with "prefix" now
+  static int FlushCommits(base::Request *req, const std::string &prefix);
+  static int FlushCommits();
+
   virtual ~Object();
 
   virtual bool IsRemovable();
@@ -78,6 +91,11 @@ class Object {
   inline bool expired() const {
     return (expiry_ == 0 || time(nullptr) >= expiry_);
   }
+  // true if the object's expiry passed less than "grace_in_s" seconds ago.
+  // false if it was expired with Expire().
+  inline bool expired_within(int grace_in_s) const {
+    return (expiry_ != 0 && time(nullptr) < expiry_ + grace_in_s);
+  }
 
   inline std::string path() const { return path_; }
   inline std::string content_type() const { return content_type_; }
@@ -110,9 +128,31 @@ class Object {
     memcpy(s, &stat_, sizeof(stat_));
   }
 
+  // sets what a bucket listing gives, for an object that's built from one
+  // rather than fetched (see Cache::GetPartial()). "mtime" may be 0 if
+  // unknown.
+  void InitFromListing(size_t size, time_t mtime, const std::string &etag);
+
+  // restarts the object's expiry, once the bucket says it hasn't changed,
+  // unless it's been expired with Expire() meanwhile
+  void Refresh();
+
   int Commit(base::Request *req);
   int Commit();
 
+  // like Commit(), but waits for metadata_commit_delay_in_ms so that several
+  // changes go in one commit. the object must be owned by a shared_ptr.
+  int DeferCommit();
+  // like DeferCommit(), but commits within "delay_in_ms" of the first change
+  // however many others follow
+  int CommitWithin(int delay_in_ms);
+  int FlushCommit(base::Request *req);
+  int FlushCommit();
+  uint64_t commit_generation();
+  // drops a deferred commit, unless there were changes since
+  // commit_generation() returned "generation"
+  void CancelCommit(uint64_t generation);
+
   int Remove();
   int Rename(std::string to);
 
@@ -128,6 +168,10 @@ class Object {
 
   virtual void UpdateStat();
 
+  // true if the object's about to be uploaded, with its metadata, so that
+  // there's no need for a separate commit
+  virtual bool IsUploadPending();
+
   inline struct stat *stat() { return &stat_; }
 
   inline void set_url(const std::string &url) { url_ = url; }
@@ -146,6 +190,14 @@ class Object {
   MetadataMap::iterator UpdateMetadata(std::unique_ptr<XAttr> attr);
 
  private:
+  // returns -EAGAIN if the object isn't large enough to copy in parts after all
+  int CommitInParts(base::Request *req);
+
+  int ScheduleCommit(int delay_in_ms, bool push_back);
+  // call with the deferred commit mutex held
+  void PostDeferredCommit();
+  int RunDeferredCommit(base::Request *req, uint64_t post);
+
   int FetchAllVersions(services::VersionFetchOptions options,
                        base::Request *req, std::string *out);
 
@@ -155,7 +207,7 @@ class Object {
   std::string path_;
   std::string content_type_;
   std::string url_;
-  bool intact_;
+  bool intact_ = false;
 
 #ifdef WITH_AWS
   std::unique_ptr<Glacier> glacier_;
@@ -168,6 +220,13 @@ class Object {
 
   // protected by _mutex
   MetadataMap metadata_;
+
+  // protected by the (static) deferred commit mutex
+  double commit_deadline_ = 0.0;
+  uint64_t commit_generation_ = 0;
+  // the latest posted deferred commit; earlier ones do nothing when they run
+  uint64_t commit_post_ = 0;
+  bool committing_ = false;
 };
 }  // namespace fs
 }  // namespace s3
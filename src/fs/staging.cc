@@ -0,0 +1,155 @@
+/*
+ * fs/staging.cc
+ * -------------------------------------------------------------------------
+ * Staging file implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fs/staging.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/statistics.h"
+
+namespace s3 {
+namespace fs {
+
+namespace {
+std::mutex s_mutex;
+std::string s_dir;
+size_t s_size = 0, s_peak_size = 0;  // protected by s_mutex
+
+std::atomic_int s_memory_files(0), s_tmpfiles(0), s_named_files(0),
+    s_quota_rejections(0);
+
+void StatsWriter(std::ostream *o) {
+  *o << "staging:\n"
+        "  in memory: "
+     << s_memory_files << ", anonymous: " << s_tmpfiles
+     << ", named: " << s_named_files
+     << "\n"
+        "  peak size: "
+     << s_peak_size
+     << "\n"
+        "  quota rejections: "
+     << s_quota_rejections << "\n";
+}
+
+base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
+
+int CreateInMemory() {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  int fd = memfd_create(PACKAGE_NAME ".local", MFD_CLOEXEC);
+  if (fd != -1) ++s_memory_files;
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+int CreateOnDisk() {
+  int fd = -1;
+
+#ifdef O_TMPFILE
+  // not every filesystem supports this, so fall back quietly
+  fd = open(s_dir.c_str(), O_TMPFILE | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd != -1) {
+    ++s_tmpfiles;
+    return fd;
+  }
+#endif
+
+  std::string temp_name = s_dir + "/" PACKAGE_NAME ".local-XXXXXX";
+
+  fd = mkstemp(&temp_name[0]);
+  if (fd == -1) return -1;
+
+  unlink(temp_name.c_str());
+  ++s_named_files;
+  return fd;
+}
+
+void Preallocate(int fd, size_t size) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  // reserve the blocks now so that we don't fragment (or run out of space)
+  // while downloading. the file's size is left for the caller to set.
+  if (size > 0 && base::Config::preallocate_staging_files() &&
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1)
+    S3_LOG(LOG_DEBUG, "Staging::Create", "fallocate failed: %s\n",
+           strerror(errno));
+#endif
+}
+}  // namespace
+
+void Staging::Init() {
+  struct stat s;
+
+  s_dir = base::Config::staging_dir();
+
+  if (stat(s_dir.c_str(), &s) == -1 || !S_ISDIR(s.st_mode)) {
+    S3_LOG(LOG_ERR, "Staging::Init", "[%s] is not a directory.\n",
+           s_dir.c_str());
+    throw std::runtime_error("invalid staging directory");
+  }
+}
+
+int Staging::Create(size_t size) {
+  int fd = -1;
+
+  if (size > 0 && size <= base::Config::staging_memory_threshold())
+    fd = CreateInMemory();
+
+  if (fd == -1) {
+    fd = CreateOnDisk();
+    if (fd == -1) return -errno;
+    Preallocate(fd, size);
+  }
+
+  return fd;
+}
+
+int Staging::Resize(size_t old_size, size_t new_size) {
+  const size_t quota = base::Config::staging_quota();
+  std::lock_guard<std::mutex> lock(s_mutex);
+
+  if (new_size > old_size && quota > 0 &&
+      s_size - old_size + new_size > quota) {
+    ++s_quota_rejections;
+    S3_LOG(LOG_WARNING, "Staging::Resize",
+           "staging quota exceeded (%zu + %zu > %zu).\n", s_size,
+           new_size - old_size, quota);
+    return -ENOSPC;
+  }
+
+  s_size = s_size - old_size + new_size;
+  if (s_size > s_peak_size) s_peak_size = s_size;
+  return 0;
+}
+}  // namespace fs
+}  // namespace s3
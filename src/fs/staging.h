@@ -0,0 +1,44 @@
+/*
+ * fs/staging.h
+ * -------------------------------------------------------------------------
+ * Local files in which open objects are staged.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_STAGING_H
+#define S3_FS_STAGING_H
+
+#include <cstddef>
+
+namespace s3 {
+namespace fs {
+class Staging {
+ public:
+  static void Init();
+
+  // creates an anonymous file in which to stage an object of "size" bytes.
+  // returns a file descriptor, or -errno.
+  static int Create(size_t size);
+
+  // adjusts the space accounted to staging files. growing fails with -ENOSPC
+  // (and changes nothing) if it would exceed staging_quota.
+  static int Resize(size_t old_size, size_t new_size);
+};
+}  // namespace fs
+}  // namespace s3
+
+#endif
@@ -0,0 +1,85 @@
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "base/config.h"
+#include "fs/block_cache.h"
+
+namespace s3 {
+namespace fs {
+namespace tests {
+
+namespace {
+constexpr size_t BLOCK_SIZE = 1024;
+
+void InitCache(const std::string &dir, size_t max_size) {
+  const std::string config_file = dir + ".conf";
+
+  {
+    std::ofstream f(config_file, std::ofstream::out | std::ofstream::trunc);
+    f << "bucket_name=test\n"
+         "service=test\n"
+         "block_cache_dir="
+      << dir
+      << "\n"
+         "block_cache_size="
+      << max_size << "\n";
+  }
+
+  base::Config::Init(config_file);
+  unlink(config_file.c_str());
+  BlockCache::Init();
+}
+
+std::string MakeTempDir() {
+  char dir[] = "/tmp/" PACKAGE_NAME ".test-block-cache-XXXXXX";
+  EXPECT_NE(mkdtemp(dir), nullptr);
+  return dir;
+}
+}  // namespace
+
+TEST(BlockCache, PutGetEvict) {
+  const std::string dir = MakeTempDir();
+  InitCache(dir, 2 * BLOCK_SIZE);
+
+  const std::string key = BlockCache::GetKey("a", "\"etag\"", BLOCK_SIZE);
+  EXPECT_FALSE(key.empty());
+  EXPECT_NE(key, BlockCache::GetKey("a", "\"other\"", BLOCK_SIZE));
+  EXPECT_TRUE(BlockCache::GetKey("a", "", BLOCK_SIZE).empty());
+
+  std::vector<char> in(BLOCK_SIZE, 'x'), out(BLOCK_SIZE);
+  EXPECT_FALSE(BlockCache::Get(key, 0, BLOCK_SIZE, &out[0]));
+
+  BlockCache::Put(key, 0, &in[0], in.size());
+  BlockCache::Put(key, 1, &in[0], in.size());
+  EXPECT_TRUE(BlockCache::Get(key, 0, BLOCK_SIZE, &out[0]));
+  EXPECT_EQ(in, out);
+  EXPECT_FALSE(BlockCache::Get(key, 0, BLOCK_SIZE / 2, &out[0]));
+
+  // block 1 is now the least recently used, so it goes first
+  BlockCache::Put(key, 2, &in[0], in.size());
+  EXPECT_FALSE(BlockCache::Get(key, 1, BLOCK_SIZE, &out[0]));
+  EXPECT_TRUE(BlockCache::Get(key, 0, BLOCK_SIZE, &out[0]));
+  EXPECT_TRUE(BlockCache::Get(key, 2, BLOCK_SIZE, &out[0]));
+
+  // blocks survive a restart
+  InitCache(dir, 2 * BLOCK_SIZE);
+  out.assign(BLOCK_SIZE, 0);
+  EXPECT_TRUE(BlockCache::Get(key, 0, BLOCK_SIZE, &out[0]));
+  EXPECT_EQ(in, out);
+
+  BlockCache::Erase(key);
+  EXPECT_FALSE(BlockCache::Get(key, 0, BLOCK_SIZE, &out[0]));
+  EXPECT_FALSE(BlockCache::Get(key, 2, BLOCK_SIZE, &out[0]));
+
+  EXPECT_EQ(rmdir(dir.c_str()), 0);
+}
+
+}  // namespace tests
+}  // namespace fs
+}  // namespace s3
@@ -0,0 +1,91 @@
+#include <list>
+#include <mutex>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "base/xml.h"
+#include "fs/list_reader.h"
+
+namespace s3 {
+namespace fs {
+namespace tests {
+
+namespace {
+constexpr char LIST_SAMPLE[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+    "<Name>bucket</Name><Prefix>dir/</Prefix><IsTruncated>false</IsTruncated>"
+    "<Contents><Key>dir/a</Key>"
+    "<LastModified>2009-10-12T17:50:30.000Z</LastModified>"
+    "<ETag>\"fba9dede5f27731c9771645a39863328\"</ETag>"
+    "<Size>434234</Size><StorageClass>STANDARD</StorageClass></Contents>"
+    "<Contents><Key>dir/b</Key>"
+    "<LastModified>1970-01-01T00:00:00.000Z</LastModified>"
+    "<ETag>\"0123456789abcdef0123456789abcdef-2\"</ETag>"
+    "<Size>0</Size><StorageClass>STANDARD</StorageClass></Contents>"
+    "<CommonPrefixes><Prefix>dir/c/</Prefix></CommonPrefixes>"
+    "</ListBucketResult>";
+
+class ListReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    static std::once_flag flag;
+    std::call_once(flag, []() { base::XmlDocument::Init(); });
+  }
+};
+}  // namespace
+
+TEST_F(ListReaderTest, ParseTime) {
+  EXPECT_EQ(ListReader::ParseTime("2009-10-12T17:50:30.000Z"), 1255369830);
+  EXPECT_EQ(ListReader::ParseTime("2009-10-12T17:50:30Z"), 1255369830);
+  EXPECT_EQ(ListReader::ParseTime("1970-01-01T00:00:00.000Z"), 0);
+  EXPECT_EQ(ListReader::ParseTime("2000-02-29T12:00:00.000Z"), 951825600);
+  EXPECT_EQ(ListReader::ParseTime(""), 0);
+  EXPECT_EQ(ListReader::ParseTime("yesterday"), 0);
+}
+
+TEST_F(ListReaderTest, FindEntries) {
+  auto doc = base::XmlDocument::Parse(LIST_SAMPLE);
+  ASSERT_TRUE(doc);
+
+  std::list<ListEntry> entries;
+  ASSERT_EQ(ListReader::FindEntries(doc.get(), &entries), 0);
+  ASSERT_EQ(entries.size(), 2u);
+
+  const ListEntry &a = entries.front();
+  EXPECT_EQ(a.key, "dir/a");
+  EXPECT_EQ(a.size, 434234u);
+  EXPECT_EQ(a.etag, "\"fba9dede5f27731c9771645a39863328\"");
+  EXPECT_EQ(a.last_modified, 1255369830);
+
+  const ListEntry &b = entries.back();
+  EXPECT_EQ(b.key, "dir/b");
+  EXPECT_EQ(b.size, 0u);
+  EXPECT_EQ(b.etag, "\"0123456789abcdef0123456789abcdef-2\"");
+  EXPECT_EQ(b.last_modified, 0);
+}
+
+TEST_F(ListReaderTest, FindEntriesAppends) {
+  auto doc = base::XmlDocument::Parse(LIST_SAMPLE);
+  ASSERT_TRUE(doc);
+
+  std::list<ListEntry> entries(1);
+  ASSERT_EQ(ListReader::FindEntries(doc.get(), &entries), 0);
+  EXPECT_EQ(entries.size(), 3u);
+  EXPECT_EQ(entries.back().key, "dir/b");
+}
+
+TEST_F(ListReaderTest, FindEntriesInEmptyListing) {
+  auto doc = base::XmlDocument::Parse(
+      "<ListBucketResult><IsTruncated>false</IsTruncated></ListBucketResult>");
+  ASSERT_TRUE(doc);
+
+  std::list<ListEntry> entries;
+  ASSERT_EQ(ListReader::FindEntries(doc.get(), &entries), 0);
+  EXPECT_TRUE(entries.empty());
+}
+
+}  // namespace tests
+}  // namespace fs
+}  // namespace s3
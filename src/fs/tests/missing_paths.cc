@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include "fs/missing_paths.h"
+
+namespace s3 {
+namespace fs {
+namespace tests {
+
+TEST(MissingPaths, Expiry) {
+  MissingPaths paths(10);
+  EXPECT_FALSE(paths.IsMissing("a", 0));
+
+  paths.Remember("a", 100);
+  EXPECT_TRUE(paths.IsMissing("a", 99));
+  EXPECT_FALSE(paths.IsMissing("a", 100));
+  EXPECT_FALSE(paths.IsMissing("b", 99));
+
+  // remembering again pushes the expiry back
+  paths.Remember("a", 200);
+  EXPECT_TRUE(paths.IsMissing("a", 150));
+}
+
+TEST(MissingPaths, Capacity) {
+  MissingPaths paths(2);
+  paths.Remember("a", 100);
+  paths.Remember("b", 100);
+  paths.Remember("a", 100);
+  paths.Remember("c", 100);
+
+  // "b" was the least recently noted
+  EXPECT_EQ(paths.size(), 2u);
+  EXPECT_TRUE(paths.IsMissing("a", 0));
+  EXPECT_FALSE(paths.IsMissing("b", 0));
+  EXPECT_TRUE(paths.IsMissing("c", 0));
+}
+
+TEST(MissingPaths, Forget) {
+  MissingPaths paths(10);
+  paths.Remember("dir", 100);
+  paths.Remember("dir/x", 100);
+
+  paths.Forget("dir");
+  EXPECT_FALSE(paths.IsMissing("dir", 0));
+  EXPECT_TRUE(paths.IsMissing("dir/x", 0));
+}
+
+TEST(MissingPaths, ForgetWithChildren) {
+  MissingPaths paths(10);
+  paths.Remember("dir", 100);
+  paths.Remember("dir/x", 100);
+  paths.Remember("dir/x/y", 100);
+  paths.Remember("dir2", 100);
+  paths.Remember("dir2/x", 100);
+  paths.Remember("di", 100);
+
+  paths.Forget("dir", true);
+  EXPECT_FALSE(paths.IsMissing("dir", 0));
+  EXPECT_FALSE(paths.IsMissing("dir/x", 0));
+  EXPECT_FALSE(paths.IsMissing("dir/x/y", 0));
+
+  // siblings that merely share a prefix stay
+  EXPECT_TRUE(paths.IsMissing("dir2", 0));
+  EXPECT_TRUE(paths.IsMissing("dir2/x", 0));
+  EXPECT_TRUE(paths.IsMissing("di", 0));
+  EXPECT_EQ(paths.size(), 3u);
+}
+
+}  // namespace tests
+}  // namespace fs
+}  // namespace s3
@@ -29,12 +29,14 @@
 #include "base/statistics.h"
 #include "base/xml.h"
 #include "crypto/buffer.h"
+#include "fs/block_cache.h"
 #include "fs/cache.h"
 #include "fs/encryption.h"
 #include "fs/file.h"
 #include "fs/list_reader.h"
 #include "fs/mime_types.h"
 #include "fs/object.h"
+#include "fs/staging.h"
 #include "operations.h"
 #include "services/service.h"
 #include "threads/pool.h"
@@ -317,6 +319,8 @@ int main(int argc, char **argv) {
     s3::fs::File::TestTransferChunkSizes();
 
     s3::fs::Cache::Init();
+    s3::fs::BlockCache::Init();
+    s3::fs::Staging::Init();
     s3::fs::Encryption::Init();
     s3::fs::MimeTypes::Init();
 
@@ -344,6 +348,8 @@ int main(int argc, char **argv) {
 
   fuse_opt_free_args(&args);
   try {
+    s3::fs::Object::FlushCommits();
+    s3::fs::File::WaitForWriteBacks();
     s3::threads::Pool::Terminate();
     // these won't do anything if statistics::init() wasn't called
     s3::base::Statistics::Collect();
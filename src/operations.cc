@@ -35,15 +35,16 @@
 #include "fs/file.h"
 #include "fs/special.h"
 #include "fs/symlink.h"
+#include "services/service.h"
 
 namespace s3 {
 
 namespace {
-std::atomic_int s_reopen_attempts(0), s_reopen_rescues(0), s_reopen_fails(0);
 std::atomic_int s_rename_attempts(0), s_rename_fails(0);
-std::atomic_int s_chmod(0), s_chown(0), s_create(0), s_flush(0), s_ftruncate(0),
-    s_mkdir(0), s_mknod(0), s_open(0), s_removexattr(0), s_rename(0),
-    s_setxattr(0), s_symlink(0), s_truncate(0), s_unlink(0), s_utimens(0);
+std::atomic_int s_chmod(0), s_chown(0), s_create(0), s_flush(0), s_fsync(0),
+    s_ftruncate(0), s_mkdir(0), s_mknod(0), s_open(0), s_removexattr(0),
+    s_rename(0), s_setxattr(0), s_symlink(0), s_truncate(0), s_unlink(0),
+    s_utimens(0);
 std::atomic_int s_getattr(0), s_getxattr(0), s_listxattr(0), s_readdir(0),
     s_readlink(0);
 std::atomic_int s_utimens_skipped(0);
@@ -53,12 +54,9 @@ inline std::string GetParent(const std::string &path) {
   return (last_slash == std::string::npos) ? "" : path.substr(0, last_slash);
 }
 
-inline void Invalidate(const std::string &path) {
-  if (!path.empty()) fs::Cache::Remove(path);
-}
-
 int Touch(const std::string &path) {
   if (path.empty()) return 0;  // succeed if path is root
+  if (base::Config::relaxed_directory_times()) return 0;
 
   auto obj = fs::Cache::Get(path);
   if (!obj) return -ENOENT;
@@ -66,20 +64,14 @@ int Touch(const std::string &path) {
   obj->set_ctime();
   obj->set_mtime();
 
-  return obj->Commit();
+  // the cached object has the new times, and the bucket gets them within
+  // directory_times_interval_in_s, however many entries change meanwhile
+  return obj->CommitWithin(base::Config::directory_times_interval_in_s() *
+                           1000);
 }
 
 void StatsWriter(std::ostream *o) {
   *o << "operations (exceptions):\n"
-        "  reopen attempts: "
-     << s_reopen_attempts
-     << "\n"
-        "  reopens rescued: "
-     << s_reopen_rescues
-     << "\n"
-        "  reopens failed: "
-     << s_reopen_fails
-     << "\n"
         "  rename attempts: "
      << s_rename_attempts
      << "\n"
@@ -98,6 +90,9 @@ void StatsWriter(std::ostream *o) {
      << "\n"
         "  flush: "
      << s_flush
+     << "\n"
+        "  fsync: "
+     << s_fsync
      << "\n"
         "  ftruncate: "
      << s_ftruncate
@@ -249,6 +244,7 @@ void Operations::BuildFuseOperations(fuse_operations *ops) {
   ops->getattr = Operations::getattr;
   ops->getxattr = Operations::getxattr;
   ops->flush = Operations::flush;
+  ops->fsync = Operations::fsync;
   ops->ftruncate = Operations::ftruncate;
   ops->listxattr = Operations::listxattr;
   ops->mkdir = Operations::mkdir;
@@ -283,7 +279,7 @@ int Operations::chmod(const char *path, mode_t mode) {
 
   obj->SetMode(mode);
 
-  return obj->Commit();
+  return obj->DeferCommit();
 
   END_TRY;
 }
@@ -304,7 +300,7 @@ int Operations::chown(const char *path, uid_t uid, gid_t gid) {
   // chown updates ctime
   obj->set_ctime();
 
-  return obj->Commit();
+  return obj->DeferCommit();
 
   END_TRY;
 }
@@ -325,9 +321,8 @@ int Operations::create(const char *path, mode_t mode,
   }
 
   std::string parent = GetParent(path);
-  Invalidate(parent);
 
-  std::unique_ptr<fs::File> f;
+  std::shared_ptr<fs::File> f;
 
   if (base::Config::use_encryption() && base::Config::encrypt_new_files())
     f.reset(new fs::EncryptedFile(path));
@@ -338,28 +333,20 @@ int Operations::create(const char *path, mode_t mode,
   f->set_uid(fuse_get_context()->uid);
   f->set_gid(fuse_get_context()->gid);
 
-  RETURN_ON_ERROR(f->Commit());
-  RETURN_ON_ERROR(Touch(parent));
-
-  // rarely, the newly created file won't be downloadable right away, so
-  // try a few times before giving up.
-  int r = 0, last_error = 0;
-  for (int i = 0; i < base::Config::max_inconsistent_state_retries(); i++) {
-    last_error = r;
-    r = fs::File::Open(static_cast<std::string>(path),
-                       s3::fs::FileOpenMode::DEFAULT, &file_info->fh);
-    if (r != -ENOENT) break;
-    S3_LOG(LOG_WARNING, "create", "retrying open on [%s] because of error %i\n",
-           path, r);
-    ++s_reopen_attempts;
-    // sleep a bit instead of retrying more times than necessary
-    base::Timer::Sleep(i + 1);
-  }
-
-  if (!r && last_error == -ENOENT) ++s_reopen_rescues;
-  if (r == -ENOENT) ++s_reopen_fails;
+  // nothing goes to the bucket until the first flush, which uploads the
+  // content and metadata together
+  int r = fs::File::Create(f, &file_info->fh);
+  if (r == -EEXIST)
+    S3_LOG(LOG_WARNING, "create", "attempt to overwrite object at [%s]\n",
+           path);
+  if (r) return r;
 
-  return r;
+  // the file exists now, so this is no reason to fail
+  r = Touch(parent);
+  if (r)
+    S3_LOG(LOG_WARNING, "create", "failed to update times of [%s]: %i\n",
+           parent.c_str(), r);
+  return 0;
 
   END_TRY;
 }
@@ -375,6 +362,21 @@ int Operations::flush(const char *path, fuse_file_info *file_info) {
   END_TRY;
 }
 
+int Operations::fsync(const char *path, int datasync,
+                      fuse_file_info *file_info) {
+  auto *f = fs::File::FromHandle(file_info->fh);
+
+  S3_LOG(LOG_DEBUG, "fsync", "path: %s, datasync: %i\n", f->path().c_str(),
+         datasync);
+  ++s_fsync;
+
+  // there's no distinction between data and metadata here: both go up with
+  // the upload
+  BEGIN_TRY;
+  return f->Fsync();
+  END_TRY;
+}
+
 int Operations::ftruncate(const char *path, off_t offset,
                           fuse_file_info *file_info) {
   auto *f = fs::File::FromHandle(file_info->fh);
@@ -411,7 +413,9 @@ int Operations::getattr(const char *path, struct stat *s) {
 
   BEGIN_TRY;
 
-  GET_OBJECT(obj, path);
+  // what a directory listing says will do here (see stat_from_listing)
+  auto obj = fs::Cache::GetPartial(path);
+  if (!obj) return -ENOENT;
 
   obj->CopyStat(s);
 
@@ -477,7 +481,6 @@ int Operations::mkdir(const char *path, mode_t mode) {
   }
 
   std::string parent = GetParent(path);
-  Invalidate(parent);
 
   fs::Directory dir(path);
 
@@ -486,6 +489,7 @@ int Operations::mkdir(const char *path, mode_t mode) {
   dir.set_gid(fuse_get_context()->gid);
 
   RETURN_ON_ERROR(dir.Commit());
+  fs::Cache::ForgetMissing(path);
 
   return Touch(parent);
 
@@ -506,7 +510,6 @@ int Operations::mknod(const char *path, mode_t mode, dev_t dev) {
   }
 
   std::string parent = GetParent(path);
-  Invalidate(parent);
 
   fs::Special obj(path);
 
@@ -518,6 +521,7 @@ int Operations::mknod(const char *path, mode_t mode, dev_t dev) {
   obj.set_gid(fuse_get_context()->gid);
 
   RETURN_ON_ERROR(obj.Commit());
+  fs::Cache::ForgetMissing(path);
 
   return Touch(parent);
 
@@ -614,7 +618,7 @@ int Operations::removexattr(const char *path, const char *name) {
   BEGIN_TRY;
   GET_OBJECT(obj, path);
   RETURN_ON_ERROR(obj->RemoveMetadata(name));
-  return obj->Commit();
+  return obj->DeferCommit();
   END_TRY;
 }
 
@@ -633,9 +637,6 @@ int Operations::rename(const char *from, const char *to) {
   // doesn't exist
   auto to_obj = fs::Cache::Get(to);
 
-  Invalidate(GetParent(from));
-  Invalidate(GetParent(to));
-
   if (to_obj) {
     if (to_obj->type() == S_IFDIR) {
       if (from_obj->type() != S_IFDIR) return -EISDIR;
@@ -648,10 +649,17 @@ int Operations::rename(const char *from, const char *to) {
   }
 
   RETURN_ON_ERROR(from_obj->Rename(to));
+  fs::Cache::ForgetMissing(to, from_obj->type() == S_IFDIR);
+
+  // if the service is strongly consistent, the object is either there or
+  // isn't going to be
+  const int attempts = services::Service::is_strongly_consistent()
+                           ? 1
+                           : base::Config::max_inconsistent_state_retries();
 
-  for (int i = 0; i < base::Config::max_inconsistent_state_retries(); i++) {
+  for (int i = 0; i < attempts; i++) {
     to_obj = fs::Cache::Get(to);
-    if (to_obj) break;
+    if (to_obj || i == attempts - 1) break;
 
     S3_LOG(LOG_WARNING, "rename",
            "newly-renamed object [%s] not available at new path\n", to);
@@ -693,7 +701,7 @@ int Operations::setxattr(const char *path, const char *name, const char *value,
   bool needs_commit = false;
   GET_OBJECT(obj, path);
   RETURN_ON_ERROR(obj->SetMetadata(name, value, size, flags, &needs_commit));
-  return needs_commit ? obj->Commit() : 0;
+  return needs_commit ? obj->DeferCommit() : 0;
   END_TRY;
 }
 
@@ -730,7 +738,6 @@ int Operations::symlink(const char *target, const char *path) {
   }
 
   std::string parent = GetParent(path);
-  Invalidate(parent);
 
   fs::Symlink link(path);
 
@@ -738,6 +745,7 @@ int Operations::symlink(const char *target, const char *path) {
   link.set_gid(fuse_get_context()->gid);
   link.SetTarget(target);
   RETURN_ON_ERROR(link.Commit());
+  fs::Cache::ForgetMissing(path);
 
   return Touch(parent);
 
@@ -753,6 +761,16 @@ int Operations::truncate(const char *path, off_t size) {
 
   BEGIN_TRY;
 
+  if (size > 0) {
+    // large files are shrunk on the server instead of being downloaded and
+    // uploaded again
+    auto f = std::dynamic_pointer_cast<fs::File>(fs::Cache::Get(path));
+    if (f) {
+      int r = f->TruncateRemote(size);
+      if (r != -ENOTSUP) return r;
+    }
+  }
+
   // passing OPEN_TRUNCATE_TO_ZERO saves us from having to download the
   // entire file if we're just going to truncate it to zero anyway.
   uint64_t handle;
@@ -786,7 +804,6 @@ int Operations::unlink(const char *path) {
   GET_OBJECT(obj, path);
 
   std::string parent = GetParent(path);
-  Invalidate(parent);
 
   RETURN_ON_ERROR(obj->Remove());
 
@@ -810,7 +827,7 @@ int Operations::utimens(const char *path, const timespec times[2]) {
   }
 
   obj->set_mtime(times[1].tv_sec);
-  return obj->Commit();
+  return obj->DeferCommit();
 
   END_TRY;
 }
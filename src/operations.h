@@ -40,6 +40,7 @@ class Operations {
   static int chown(const char *path, uid_t uid, gid_t gid);
   static int create(const char *path, mode_t mode, fuse_file_info *file_info);
   static int flush(const char *path, fuse_file_info *file_info);
+  static int fsync(const char *path, int datasync, fuse_file_info *file_info);
   static int ftruncate(const char *path, off_t offset,
                        fuse_file_info *file_info);
   static int getattr(const char *path, struct stat *s);
@@ -21,6 +21,7 @@
 
 #include "services/aws/file_transfer.h"
 
+#include <algorithm>
 #include <atomic>
 #include <string>
 #include <vector>
@@ -29,7 +30,9 @@
 #include "base/logger.h"
 #include "base/statistics.h"
 #include "base/xml.h"
+#include "crypto/encoder.h"
 #include "crypto/hash.h"
+#include "crypto/hex.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
 #include "threads/parallel_work_queue.h"
@@ -41,20 +44,51 @@ namespace aws {
 
 namespace {
 constexpr size_t UPLOAD_CHUNK_SIZE = 5 * 1024 * 1024;
+constexpr size_t MAX_PARTS = 10000;
 
 constexpr char MULTIPART_ETAG_XPATH[] = "/CompleteMultipartUploadResult/ETag";
+constexpr char COPY_PART_ETAG_XPATH[] = "/CopyPartResult/ETag";
 constexpr char MULTIPART_UPLOAD_ID_XPATH[] =
     "/InitiateMultipartUploadResult/UploadId";
 
 std::atomic_int s_uploads_multi_chunks_failed(0);
+std::atomic_int s_uploads_multi_chunks_copied(0),
+    s_uploads_multi_chunk_copies_failed(0);
+std::atomic_int s_copies_multi(0), s_copies_multi_failed(0);
+std::atomic_int s_copies_multi_parts(0), s_copies_multi_parts_failed(0);
 
 void StatsWriter(std::ostream *o) {
   *o << "aws multi-part uploads:\n"
         "  chunks failed: "
-     << s_uploads_multi_chunks_failed << "\n";
+     << s_uploads_multi_chunks_failed
+     << "\n"
+        "  unchanged chunks copied: "
+     << s_uploads_multi_chunks_copied
+     << ", failed: " << s_uploads_multi_chunk_copies_failed
+     << "\n"
+        "aws multi-part copies:\n"
+        "  succeeded: "
+     << s_copies_multi << ", failed: " << s_copies_multi_failed
+     << "\n"
+        "  parts copied: "
+     << s_copies_multi_parts << ", failed: " << s_copies_multi_parts_failed
+     << "\n";
 }
 
 base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
+
+std::string BuildCompleteUpload(const std::vector<std::string> &part_etags) {
+  std::string complete_upload = "<CompleteMultipartUpload>";
+
+  for (size_t i = 0; i < part_etags.size(); i++) {
+    // part numbers are 1-based
+    complete_upload += "<Part><PartNumber>" + std::to_string(i + 1) +
+                       "</PartNumber><ETag>" + part_etags[i] + "</ETag></Part>";
+  }
+
+  complete_upload += "</CompleteMultipartUpload>";
+  return complete_upload;
+}
 }  // namespace
 
 FileTransfer::FileTransfer() {
@@ -65,16 +99,66 @@ FileTransfer::FileTransfer() {
 
 size_t FileTransfer::upload_chunk_size() { return upload_chunk_size_; }
 
-int FileTransfer::UploadMulti(const std::string &url, size_t size,
-                              const ReadChunk &on_read,
-                              std::string *returned_etag) {
+size_t FileTransfer::copy_chunk_size() {
+  return base::Config::copy_chunk_size();
+}
+
+int FileTransfer::CopyMulti(base::Request *req, const std::string &source_url,
+                            const std::string &url, size_t size,
+                            const std::string &source_etag,
+                            const SetHeaders &set_headers,
+                            std::string *returned_etag) {
+  // parts may need to be larger than copy_chunk_size() to stay within the
+  // limit on the number of parts
+  const size_t part_size =
+      std::max(copy_chunk_size(), (size + MAX_PARTS - 1) / MAX_PARTS);
+  const size_t num_parts = (size + part_size - 1) / part_size;
+  std::vector<UploadRange> parts(num_parts);
+  for (size_t i = 0; i < num_parts; i++) {
+    UploadRange *part = &parts[i];
+
+    part->id = i;
+    part->offset = i * part_size;
+    part->size = (i != num_parts - 1) ? part_size : (size - part_size * i);
+  }
+
   std::string upload_id;
-  int r;
-  r = threads::Pool::Call(threads::PoolId::PR_REQ_0,
-                          bind(&FileTransfer::UploadMultiInit, this,
-                               std::placeholders::_1, url, &upload_id));
+  int r = UploadMultiInit(req, url, set_headers, "", &upload_id);
   if (r) return r;
 
+  threads::ParallelWorkQueue<UploadRange> copy(
+      parts.begin(), parts.end(),
+      bind(&FileTransfer::CopyPart, this, std::placeholders::_1, source_url,
+           url, upload_id, source_etag, std::placeholders::_2, false),
+      bind(&FileTransfer::CopyPart, this, std::placeholders::_1, source_url,
+           url, upload_id, source_etag, std::placeholders::_2, true));
+
+  r = copy.Process();
+
+  if (r == 0) {
+    std::vector<std::string> part_etags;
+    for (const auto &part : parts) part_etags.push_back(part.etag);
+
+    r = UploadMultiComplete(req, url, upload_id,
+                            BuildCompleteUpload(part_etags), returned_etag);
+  } else {
+    UploadMultiCancel(req, url, upload_id);
+  }
+
+  if (r)
+    ++s_copies_multi_failed;
+  else
+    ++s_copies_multi;
+
+  return r;
+}
+
+int FileTransfer::UploadMulti(const std::string &url, size_t size,
+                              const ReadChunk &on_read,
+                              std::string *returned_etag,
+                              const std::string &source_etag,
+                              const IsChunkUnchanged &is_unchanged,
+                              const SetHeaders &set_headers) {
   const size_t num_parts = (size + upload_chunk_size_ - 1) / upload_chunk_size_;
   std::vector<UploadRange> parts(num_parts);
   for (size_t i = 0; i < num_parts; i++) {
@@ -86,12 +170,56 @@ int FileTransfer::UploadMulti(const std::string &url, size_t size,
                                       : (size - upload_chunk_size_ * i);
   }
 
+  // parts copied on the server would have to be read just to hash them, so
+  // if there are any, leave the etag out and let the caller commit
+  bool copies_parts = false;
+  if (!source_etag.empty() && is_unchanged) {
+    for (const auto &part : parts) {
+      if (is_unchanged(part.size, part.offset)) {
+        copies_parts = true;
+        break;
+      }
+    }
+  }
+
+  std::string etag;
+  int r;
+  if (set_headers && !copies_parts) {
+    // the metadata headers go on the initiating request, and have to include
+    // the etag of the finished object: the md5 of its parts' md5s, followed by
+    // the number of parts. so hash the parts now (UploadPart() won't have to).
+    crypto::Md5::Incremental etag_hash;
+    uint8_t md5[crypto::Md5::HASH_LEN];
+
+    for (auto &part : parts) {
+      r = ComputeMd5(part.size, part.offset, on_read, md5);
+      if (r) return r;
+      part.etag = crypto::Encoder::Encode<crypto::HexWithQuotes>(
+          md5, crypto::Md5::HASH_LEN);
+      etag_hash.Update(md5, crypto::Md5::HASH_LEN);
+    }
+
+    etag_hash.Finish(md5);
+    etag = "\"" +
+           crypto::Encoder::Encode<crypto::Hex>(md5, crypto::Md5::HASH_LEN) +
+           "-" + std::to_string(num_parts) + "\"";
+  }
+
+  std::string upload_id;
+  r = threads::Pool::Call(
+      threads::PoolId::PR_REQ_0,
+      bind(&FileTransfer::UploadMultiInit, this, std::placeholders::_1, url,
+           set_headers, etag, &upload_id));
+  if (r) return r;
+
   threads::ParallelWorkQueue<UploadRange> upload(
       parts.begin(), parts.end(),
       bind(&FileTransfer::UploadPart, this, std::placeholders::_1, url,
-           upload_id, on_read, std::placeholders::_2, false),
+           upload_id, on_read, source_etag, is_unchanged,
+           std::placeholders::_2, false),
       bind(&FileTransfer::UploadPart, this, std::placeholders::_1, url,
-           upload_id, on_read, std::placeholders::_2, true));
+           upload_id, on_read, source_etag, is_unchanged,
+           std::placeholders::_2, true));
 
   r = upload.Process();
 
@@ -103,44 +231,89 @@ int FileTransfer::UploadMulti(const std::string &url, size_t size,
     return r;
   }
 
-  std::string complete_upload = "<CompleteMultipartUpload>";
-
-  for (size_t i = 0; i < parts.size(); i++) {
-    // part numbers are 1-based
-    complete_upload += "<Part><PartNumber>" + std::to_string(i + 1) +
-                       "</PartNumber><ETag>" + parts[i].etag + "</ETag></Part>";
-  }
-
-  complete_upload += "</CompleteMultipartUpload>";
+  std::vector<std::string> part_etags;
+  for (const auto &part : parts) part_etags.push_back(part.etag);
 
   return threads::Pool::Call(
       threads::PoolId::PR_REQ_0,
       bind(&FileTransfer::UploadMultiComplete, this, std::placeholders::_1, url,
-           upload_id, complete_upload, returned_etag));
+           upload_id, BuildCompleteUpload(part_etags), returned_etag));
+}
+
+int FileTransfer::UploadStreamBegin(base::Request *req, const std::string &url,
+                                    std::string *upload_id) {
+  return UploadMultiInit(req, url, {}, "", upload_id);
+}
+
+int FileTransfer::UploadStreamPart(base::Request *req, const std::string &url,
+                                   const std::string &upload_id, int part,
+                                   size_t size, off_t offset,
+                                   const ReadChunk &on_read,
+                                   std::string *etag) {
+  UploadRange range;
+  range.id = part;
+  range.size = size;
+  range.offset = offset;
+
+  int r = UploadPart(req, url, upload_id, on_read, "", {}, &range, false);
+  if (r) return r;
+
+  *etag = range.etag;
+  return 0;
+}
+
+int FileTransfer::UploadStreamEnd(base::Request *req, const std::string &url,
+                                  const std::string &upload_id,
+                                  const std::vector<std::string> &part_etags,
+                                  std::string *returned_etag) {
+  return UploadMultiComplete(req, url, upload_id,
+                             BuildCompleteUpload(part_etags), returned_etag);
+}
+
+int FileTransfer::UploadStreamAbort(base::Request *req, const std::string &url,
+                                    const std::string &upload_id) {
+  return UploadMultiCancel(req, url, upload_id);
 }
 
 int FileTransfer::UploadPart(base::Request *req, const std::string &url,
                              const std::string &upload_id,
-                             const ReadChunk &on_read, UploadRange *range,
-                             bool is_retry) {
+                             const ReadChunk &on_read,
+                             const std::string &source_etag,
+                             const IsChunkUnchanged &is_unchanged,
+                             UploadRange *range, bool is_retry) {
   if (is_retry) ++s_uploads_multi_chunks_failed;
 
-  std::vector<char> buffer;
-  int r = on_read(range->size, range->offset, &buffer);
-  if (r) return r;
-
-  range->etag =
-      crypto::Hash::Compute<crypto::Md5, crypto::HexWithQuotes>(buffer);
+  if (!source_etag.empty() && is_unchanged &&
+      is_unchanged(range->size, range->offset)) {
+    // if the copy fails for whatever reason, we can still upload the part
+    if (UploadPartCopy(req, url, url, upload_id, source_etag, range) == 0) {
+      ++s_uploads_multi_chunks_copied;
+      return 0;
+    }
+    ++s_uploads_multi_chunk_copies_failed;
+  }
 
   req->Init(base::HttpMethod::PUT);
 
   // part numbers are 1-based
   req->SetUrl(url + "?partNumber=" + std::to_string(range->id + 1) +
               "&uploadId=" + upload_id);
-  req->SetInputBuffer(std::move(buffer));
+
+  // parts hashed by UploadMulti(), or by an earlier attempt, already have
+  // their etags
+  const bool hashed = !range->etag.empty();
+  uint8_t md5[crypto::Md5::HASH_LEN];
+  int r = SetUploadSource(req, range->size, range->offset, on_read,
+                          hashed ? nullptr : md5);
+  if (r) return r;
+
+  if (!hashed)
+    range->etag = crypto::Encoder::Encode<crypto::HexWithQuotes>(
+        md5, crypto::Md5::HASH_LEN);
 
   req->Run(base::Config::transfer_timeout_in_s());
 
+  if (req->input_source_error()) return req->input_source_error();
   if (req->response_code() != base::HTTP_SC_OK) return -EIO;
 
   if (req->response_header("ETag") != range->etag) {
@@ -153,11 +326,68 @@ int FileTransfer::UploadPart(base::Request *req, const std::string &url,
   return 0;
 }
 
+int FileTransfer::CopyPart(base::Request *req, const std::string &source_url,
+                           const std::string &url,
+                           const std::string &upload_id,
+                           const std::string &source_etag, UploadRange *range,
+                           bool is_retry) {
+  if (is_retry) ++s_copies_multi_parts_failed;
+
+  int r = UploadPartCopy(req, source_url, url, upload_id, source_etag, range);
+  if (r) {
+    // the source changed, so there's no point trying again
+    if (req->response_code() == base::HTTP_SC_PRECONDITION_FAILED)
+      return -EBUSY;
+    return -EAGAIN;
+  }
+
+  ++s_copies_multi_parts;
+  return 0;
+}
+
+int FileTransfer::UploadPartCopy(base::Request *req,
+                                 const std::string &source_url,
+                                 const std::string &url,
+                                 const std::string &upload_id,
+                                 const std::string &source_etag,
+                                 UploadRange *range) {
+  req->Init(base::HttpMethod::PUT);
+
+  // part numbers are 1-based
+  req->SetUrl(url + "?partNumber=" + std::to_string(range->id + 1) +
+              "&uploadId=" + upload_id);
+  req->SetHeader("x-amz-copy-source", source_url);
+  req->SetHeader("x-amz-copy-source-if-match", source_etag);
+  req->SetHeader("x-amz-copy-source-range",
+                 "bytes=" + std::to_string(range->offset) + "-" +
+                     std::to_string(range->offset + range->size - 1));
+
+  req->Run(base::Config::transfer_timeout_in_s());
+
+  if (req->response_code() != base::HTTP_SC_OK) {
+    S3_LOG(LOG_DEBUG, "FileTransfer::UploadPartCopy",
+           "failed to copy part %i of [%s] with error %li.\n", range->id,
+           url.c_str(), req->response_code());
+    return -EIO;
+  }
+
+  auto doc = base::XmlDocument::Parse(req->GetOutputAsString());
+  if (!doc) return -EIO;
+
+  int r = doc->Find(COPY_PART_ETAG_XPATH, &range->etag);
+  if (r) return r;
+
+  return range->etag.empty() ? -EIO : 0;
+}
+
 int FileTransfer::UploadMultiInit(base::Request *req, const std::string &url,
+                                  const SetHeaders &set_headers,
+                                  const std::string &etag,
                                   std::string *upload_id) {
   req->Init(base::HttpMethod::POST);
   req->SetUrl(url + "?uploads");
   req->SetHeader("Content-Type", "");
+  if (set_headers) set_headers(req, etag);
 
   req->Run();
 
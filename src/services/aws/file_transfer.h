@@ -34,10 +34,31 @@ class FileTransfer : public services::FileTransfer {
   FileTransfer();
 
   size_t upload_chunk_size() override;
+  size_t copy_chunk_size() override;
+
+  int CopyMulti(base::Request *req, const std::string &source_url,
+                const std::string &url, size_t size,
+                const std::string &source_etag, const SetHeaders &set_headers,
+                std::string *returned_etag) override;
+
+  int UploadStreamBegin(base::Request *req, const std::string &url,
+                        std::string *upload_id) override;
+  int UploadStreamPart(base::Request *req, const std::string &url,
+                       const std::string &upload_id, int part, size_t size,
+                       off_t offset, const ReadChunk &on_read,
+                       std::string *etag) override;
+  int UploadStreamEnd(base::Request *req, const std::string &url,
+                      const std::string &upload_id,
+                      const std::vector<std::string> &part_etags,
+                      std::string *returned_etag) override;
+  int UploadStreamAbort(base::Request *req, const std::string &url,
+                        const std::string &upload_id) override;
 
  protected:
   int UploadMulti(const std::string &url, size_t size, const ReadChunk &on_read,
-                  std::string *returned_etag) override;
+                  std::string *returned_etag, const std::string &source_etag,
+                  const IsChunkUnchanged &is_unchanged,
+                  const SetHeaders &set_headers) override;
 
  private:
   struct UploadRange {
@@ -49,9 +70,21 @@ class FileTransfer : public services::FileTransfer {
 
   int UploadPart(base::Request *req, const std::string &url,
                  const std::string &upload_id, const ReadChunk &on_read,
-                 UploadRange *range, bool is_retry);
+                 const std::string &source_etag,
+                 const IsChunkUnchanged &is_unchanged, UploadRange *range,
+                 bool is_retry);
+
+  int CopyPart(base::Request *req, const std::string &source_url,
+               const std::string &url, const std::string &upload_id,
+               const std::string &source_etag, UploadRange *range,
+               bool is_retry);
+
+  int UploadPartCopy(base::Request *req, const std::string &source_url,
+                     const std::string &url, const std::string &upload_id,
+                     const std::string &source_etag, UploadRange *range);
 
   int UploadMultiInit(base::Request *req, const std::string &url,
+                      const SetHeaders &set_headers, const std::string &etag,
                       std::string *upload_id);
 
   int UploadMultiCancel(base::Request *req, const std::string &url,
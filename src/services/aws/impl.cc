@@ -97,6 +97,8 @@ bool Impl::is_next_marker_supported() const { return true; }
 
 bool Impl::is_listobjectsv2_supported() const { return true; }
 
+bool Impl::is_strongly_consistent() const { return true; }
+
 base::RequestHook *Impl::hook() { return this; }
 
 services::FileTransfer *Impl::file_transfer() { return file_transfer_.get(); }
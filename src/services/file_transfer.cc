@@ -21,11 +21,13 @@
 
 #include "services/file_transfer.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
 
+#include "base/buffer_pool.h"
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
@@ -42,6 +44,9 @@ namespace s3 {
 namespace services {
 
 namespace {
+// size of the pieces read to compute the hash of data to be uploaded
+constexpr size_t HASH_READ_SIZE = 128 * 1024;
+
 struct DownloadRange {
   size_t size;
   off_t offset;
@@ -88,27 +93,33 @@ void StatsWriter(std::ostream *o) {
 
 base::Statistics::Writers::Entry s_writer(StatsWriter, 0);
 
-int DownloadPart(base::Request *req, const std::string &url,
-                 DownloadRange *range, const FileTransfer::WriteChunk &on_write,
-                 bool is_retry) {
+int DownloadPart(base::Request *req, FileTransfer *transfer,
+                 const std::string &url, DownloadRange *range,
+                 const FileTransfer::WriteChunk &on_write,
+                 const FileTransfer::SkipChunk &skip_chunk,
+                 const base::CancelToken *cancel, bool is_retry) {
   // yes, relying on is_retry will result in the chunks failed count being off
   // by one, maybe, but we don't care
   if (is_retry) ++s_downloads_multi_chunks_failed;
 
-  req->Init(base::HttpMethod::GET);
-  req->SetUrl(url);
-  req->SetHeader("Range", std::string("bytes=") +
-                              std::to_string(range->offset) + std::string("-") +
-                              std::to_string(range->offset + range->size));
-
-  req->Run(base::Config::transfer_timeout_in_s());
+  if (skip_chunk && skip_chunk(range->size, range->offset)) return 0;
 
-  if (req->response_code() != s3::base::HTTP_SC_PARTIAL_CONTENT)
-    return -EIO;
-  else if (req->output_buffer().size() < range->size)
-    return -EIO;
+  return transfer->DownloadChunk(req, url, range->size, range->offset,
+                                 on_write, cancel);
+}
 
-  return on_write(&req->output_buffer()[0], range->size, range->offset);
+// streams at most "size" bytes of a response with code "expected_code" to
+// "on_write", as data at "offset"
+void SetChunkSink(base::Request *req, size_t size, off_t offset,
+                  int expected_code, const FileTransfer::WriteChunk &on_write) {
+  req->SetOutputSink([req, size, offset, expected_code, on_write](
+                         const char *data, size_t data_size, off_t position) {
+    if (req->response_code() != expected_code) return -EIO;
+    if (static_cast<size_t>(position) >= size) return 0;
+    return on_write(data,
+                    std::min(data_size, size - static_cast<size_t>(position)),
+                    offset + position);
+  });
 }
 
 int IncrementOnResult(int r, std::atomic_int *success,
@@ -130,53 +141,178 @@ size_t FileTransfer::upload_chunk_size() {
   return 0;  // this FileTransfer impl doesn't do chunks
 }
 
+size_t FileTransfer::copy_chunk_size() {
+  return 0;  // nor does it copy in parts
+}
+
+int FileTransfer::CopyMulti(base::Request * /* req */,
+                            const std::string & /* source_url */,
+                            const std::string & /* url */, size_t /* size */,
+                            const std::string & /* source_etag */,
+                            const SetHeaders & /* set_headers */,
+                            std::string * /* returned_etag */) {
+  return -ENOTSUP;
+}
+
 int FileTransfer::Download(const std::string &url, size_t size,
-                           const WriteChunk &on_write) {
+                           const WriteChunk &on_write,
+                           const NextChunk &next_chunk,
+                           const SkipChunk &skip_chunk,
+                           const base::CancelToken *cancel) {
   if (download_chunk_size() > 0 && size > download_chunk_size())
-    return IncrementOnResult(DownloadMulti(url, size, on_write),
-                             &s_downloads_multi, &s_downloads_multi_failed);
+    return IncrementOnResult(
+        DownloadMulti(url, size, on_write, next_chunk, skip_chunk, cancel),
+        &s_downloads_multi, &s_downloads_multi_failed);
+  else if (skip_chunk && skip_chunk(size, 0))
+    return 0;
   else
     return IncrementOnResult(
         threads::Pool::Call(threads::PoolId::PR_REQ_1,
                             bind(&FileTransfer::DownloadSingle, this,
-                                 std::placeholders::_1, url, size, on_write)),
+                                 std::placeholders::_1, url, size, on_write,
+                                 cancel)),
         &s_downloads_single, &s_downloads_single_failed);
 }
 
 int FileTransfer::Upload(const std::string &url, size_t size,
-                         const ReadChunk &on_read, std::string *returned_etag) {
+                         const ReadChunk &on_read, std::string *returned_etag,
+                         const std::string &source_etag,
+                         const IsChunkUnchanged &is_unchanged,
+                         const SetHeaders &set_headers) {
   if (upload_chunk_size() > 0 && size > upload_chunk_size())
-    return IncrementOnResult(UploadMulti(url, size, on_read, returned_etag),
-                             &s_uploads_multi, &s_uploads_multi_failed);
+    return IncrementOnResult(
+        UploadMulti(url, size, on_read, returned_etag, source_etag,
+                    is_unchanged, set_headers),
+        &s_uploads_multi, &s_uploads_multi_failed);
   else
     return IncrementOnResult(
         threads::Pool::Call(
             threads::PoolId::PR_REQ_1,
             bind(&FileTransfer::UploadSingle, this, std::placeholders::_1, url,
-                 size, on_read, returned_etag)),
+                 size, on_read, returned_etag, set_headers)),
         &s_uploads_single, &s_uploads_single_failed);
 }
 
+int FileTransfer::DownloadChunk(base::Request *req, const std::string &url,
+                                size_t size, off_t offset,
+                                const WriteChunk &on_write,
+                                const base::CancelToken *cancel) {
+  req->Init(base::HttpMethod::GET);
+  req->SetUrl(url);
+  req->SetCancelToken(cancel);
+  req->SetHeader("Range", std::string("bytes=") + std::to_string(offset) +
+                              std::string("-") +
+                              std::to_string(offset + size));
+  SetChunkSink(req, size, offset, base::HTTP_SC_PARTIAL_CONTENT, on_write);
+
+  req->Run(base::Config::transfer_timeout_in_s());
+
+  if (req->cancelled())
+    return -ECANCELED;
+  else if (req->output_sink_error())
+    return req->output_sink_error();
+  else if (req->response_code() != s3::base::HTTP_SC_PARTIAL_CONTENT)
+    return -EIO;
+  else if (req->output_size() < size)
+    return -EIO;
+
+  return 0;
+}
+
+int FileTransfer::SetUploadSource(base::Request *req, size_t size,
+                                  off_t offset, const ReadChunk &on_read,
+                                  uint8_t *md5) {
+  if (md5) {
+    int r = ComputeMd5(size, offset, on_read, md5);
+    if (r) return r;
+  }
+
+  req->SetInputSource(
+      [on_read, offset](size_t piece, off_t position, char *buffer) {
+        return on_read(piece, offset + position, buffer);
+      },
+      size);
+  return 0;
+}
+
+int FileTransfer::ComputeMd5(size_t size, off_t offset,
+                             const ReadChunk &on_read, uint8_t *md5) {
+  crypto::Md5::Incremental hash;
+  auto buffer = base::BufferPool::Get(std::min(size, HASH_READ_SIZE));
+
+  for (size_t o = 0; o < size; o += HASH_READ_SIZE) {
+    const size_t piece = std::min(size - o, HASH_READ_SIZE);
+    int r = on_read(piece, offset + o, buffer.get());
+    if (r) return r;
+    hash.Update(reinterpret_cast<const uint8_t *>(buffer.get()), piece);
+  }
+
+  hash.Finish(md5);
+  return 0;
+}
+
+int FileTransfer::UploadStreamBegin(base::Request * /* req */,
+                                    const std::string & /* url */,
+                                    std::string * /* upload_id */) {
+  return -ENOTSUP;
+}
+
+int FileTransfer::UploadStreamPart(base::Request * /* req */,
+                                   const std::string & /* url */,
+                                   const std::string & /* upload_id */,
+                                   int /* part */, size_t /* size */,
+                                   off_t /* offset */,
+                                   const ReadChunk & /* on_read */,
+                                   std::string * /* etag */) {
+  return -ENOTSUP;
+}
+
+int FileTransfer::UploadStreamEnd(
+    base::Request * /* req */, const std::string & /* url */,
+    const std::string & /* upload_id */,
+    const std::vector<std::string> & /* part_etags */,
+    std::string * /* returned_etag */) {
+  return -ENOTSUP;
+}
+
+int FileTransfer::UploadStreamAbort(base::Request * /* req */,
+                                    const std::string & /* url */,
+                                    const std::string & /* upload_id */) {
+  return -ENOTSUP;
+}
+
 int FileTransfer::DownloadSingle(base::Request *req, const std::string &url,
-                                 size_t size, const WriteChunk &on_write) {
+                                 size_t size, const WriteChunk &on_write,
+                                 const base::CancelToken *cancel) {
   int rc = 0;
 
   req->Init(base::HttpMethod::GET);
   req->SetUrl(url);
+  req->SetCancelToken(cancel);
+  SetChunkSink(req, size, 0, base::HTTP_SC_OK, on_write);
 
   req->Run(base::Config::transfer_timeout_in_s());
   rc = req->response_code();
 
-  if (rc == base::HTTP_SC_NOT_FOUND)
+  if (req->cancelled())
+    return -ECANCELED;
+  else if (req->output_sink_error())
+    return req->output_sink_error();
+  else if (rc == base::HTTP_SC_NOT_FOUND)
     return -ENOENT;
   else if (rc != base::HTTP_SC_OK)
     return -EIO;
+  else if (req->output_size() < size)
+    return -EIO;
 
-  return on_write(&req->output_buffer()[0], req->output_buffer().size(), 0);
+  return 0;
 }
 
 int FileTransfer::DownloadMulti(const std::string &url, size_t size,
-                                const FileTransfer::WriteChunk &on_write) {
+                                const FileTransfer::WriteChunk &on_write,
+                                const FileTransfer::NextChunk &next_chunk,
+                                const FileTransfer::SkipChunk &skip_chunk,
+                                const base::CancelToken *cancel) {
   size_t num_parts = (size + download_chunk_size() - 1) / download_chunk_size();
   std::vector<DownloadRange> parts(num_parts);
 
@@ -188,24 +324,37 @@ int FileTransfer::DownloadMulti(const std::string &url, size_t size,
                                        : (size - download_chunk_size() * i);
   }
 
+  threads::ParallelWorkQueue<DownloadRange>::NextPartCallback next_part;
+
+  if (next_chunk) {
+    next_part = [this, &next_chunk]() {
+      off_t offset = next_chunk();
+      return (offset < 0) ? -1
+                          : static_cast<int>(offset / download_chunk_size());
+    };
+  }
+
   threads::ParallelWorkQueue<DownloadRange> dl(
       parts.begin(), parts.end(),
-      bind(&DownloadPart, std::placeholders::_1, url, std::placeholders::_2,
-           on_write, false),
-      bind(&DownloadPart, std::placeholders::_1, url, std::placeholders::_2,
-           on_write, true));
-  return dl.Process();
+      bind(&DownloadPart, std::placeholders::_1, this, url,
+           std::placeholders::_2, on_write, skip_chunk, cancel, false),
+      bind(&DownloadPart, std::placeholders::_1, this, url,
+           std::placeholders::_2, on_write, skip_chunk, cancel, true),
+      -1, -1, next_part);
+  return dl.Process(cancel);
 }
 
 int FileTransfer::UploadSingle(base::Request *req, const std::string &url,
                                size_t size, const ReadChunk &on_read,
-                               std::string *returned_etag) {
-  std::vector<char> buffer;
-  int r = on_read(size, 0, &buffer);
-  if (r) return r;
-
+                               std::string *returned_etag,
+                               const SetHeaders &set_headers) {
   uint8_t read_hash[crypto::Md5::HASH_LEN];
-  crypto::Hash::Compute<crypto::Md5>(buffer, read_hash);
+
+  req->Init(base::HttpMethod::PUT);
+  req->SetUrl(url);
+
+  int r = SetUploadSource(req, size, 0, on_read, read_hash);
+  if (r) return r;
 
   const std::string expected_md5_b64 =
       crypto::Encoder::Encode<crypto::Base64>(read_hash, crypto::Md5::HASH_LEN);
@@ -213,14 +362,15 @@ int FileTransfer::UploadSingle(base::Request *req, const std::string &url,
       crypto::Encoder::Encode<crypto::HexWithQuotes>(read_hash,
                                                      crypto::Md5::HASH_LEN);
 
-  req->Init(base::HttpMethod::PUT);
-  req->SetUrl(url);
-
   req->SetHeader("Content-MD5", expected_md5_b64);
-  req->SetInputBuffer(std::move(buffer));
+
+  // a single-part object's etag is its md5
+  if (set_headers) set_headers(req, expected_md5_hex);
 
   req->Run(base::Config::transfer_timeout_in_s());
 
+  if (req->input_source_error()) return req->input_source_error();
+
   if (req->response_code() != base::HTTP_SC_OK) {
     S3_LOG(LOG_WARNING, "FileTransfer::UploadSingle",
            "failed to upload for [%s].\n", url.c_str());
@@ -243,7 +393,10 @@ int FileTransfer::UploadSingle(base::Request *req, const std::string &url,
 
 int FileTransfer::UploadMulti(const std::string &url, size_t size,
                               const ReadChunk &on_read,
-                              std::string *returned_etag) {
+                              std::string *returned_etag,
+                              const std::string &source_etag,
+                              const IsChunkUnchanged &is_unchanged,
+                              const SetHeaders &set_headers) {
   return -ENOTSUP;
 }
 
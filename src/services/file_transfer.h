@@ -22,6 +22,7 @@
 #ifndef S3_SERVICES_FILE_TRANSFER_H
 #define S3_SERVICES_FILE_TRANSFER_H
 
+#include <cstdint>
 #include <functional>
 #include <string>
 #include <vector>
@@ -32,31 +33,107 @@ namespace s3 {
 namespace services {
 class FileTransfer {
  public:
+  // receives downloaded data as it arrives: each chunk is written in one or
+  // more consecutive pieces, starting over from the beginning of the chunk if
+  // its download is retried.
   using WriteChunk = std::function<int(const char *, size_t, off_t)>;
-  using ReadChunk = std::function<int(size_t, off_t, std::vector<char> *)>;
+  // fills the buffer with the given range of the data to upload. ranges are
+  // read as they're sent, so a chunk may be read in several pieces, and more
+  // than once.
+  using ReadChunk = std::function<int(size_t, off_t, char *)>;
+  // returns the offset of a chunk that should be downloaded ahead of the
+  // others, or -1 if there's no preference.
+  using NextChunk = std::function<off_t()>;
+  // called before a chunk is downloaded; returns true if the caller has
+  // already written the chunk (from a local cache, say) and it can be skipped.
+  using SkipChunk = std::function<bool(size_t, off_t)>;
+  // returns true if the chunk is identical to the same range of the object
+  // already at the upload url, so that it can be copied rather than uploaded.
+  using IsChunkUnchanged = std::function<bool(size_t, off_t)>;
+  // adds the object's metadata headers to the request that creates the
+  // object, so that no separate commit is needed. the string is the etag the
+  // finished object will have, or empty if that isn't known ahead of time.
+  using SetHeaders = std::function<void(base::Request *, const std::string &)>;
 
   virtual ~FileTransfer() = default;
 
   virtual size_t download_chunk_size();
   virtual size_t upload_chunk_size();
+  virtual size_t copy_chunk_size();
 
-  int Download(const std::string &url, size_t size, const WriteChunk &on_write);
+  // stops within a chunk, failing with -ECANCELED, once "cancel" is cancelled
+  int Download(const std::string &url, size_t size, const WriteChunk &on_write,
+               const NextChunk &next_chunk = {},
+               const SkipChunk &skip_chunk = {},
+               const base::CancelToken *cancel = nullptr);
   int Upload(const std::string &url, size_t size, const ReadChunk &on_read,
-             std::string *returned_etag);
+             std::string *returned_etag, const std::string &source_etag = "",
+             const IsChunkUnchanged &is_unchanged = {},
+             const SetHeaders &set_headers = {});
+
+  // copies "size" bytes of the object at "source_url", which must still have
+  // etag "source_etag", to "url" on the server, in parts of (at least)
+  // copy_chunk_size() that are copied in parallel. the new object gets its
+  // metadata from "set_headers" (with an empty etag, since that isn't known
+  // ahead of time). services that can't do this return -ENOTSUP.
+  virtual int CopyMulti(base::Request *req, const std::string &source_url,
+                        const std::string &url, size_t size,
+                        const std::string &source_etag,
+                        const SetHeaders &set_headers,
+                        std::string *returned_etag);
+
+  // fetches a single byte range of the object at "url".
+  int DownloadChunk(base::Request *req, const std::string &url, size_t size,
+                    off_t offset, const WriteChunk &on_write,
+                    const base::CancelToken *cancel = nullptr);
+
+  // multipart uploads whose parts are supplied as they become available.
+  // services that can't do this return -ENOTSUP from UploadStreamBegin().
+  virtual int UploadStreamBegin(base::Request *req, const std::string &url,
+                                std::string *upload_id);
+  virtual int UploadStreamPart(base::Request *req, const std::string &url,
+                               const std::string &upload_id, int part,
+                               size_t size, off_t offset,
+                               const ReadChunk &on_read, std::string *etag);
+  virtual int UploadStreamEnd(base::Request *req, const std::string &url,
+                              const std::string &upload_id,
+                              const std::vector<std::string> &part_etags,
+                              std::string *returned_etag);
+  virtual int UploadStreamAbort(base::Request *req, const std::string &url,
+                                const std::string &upload_id);
 
  protected:
+  // has "req" (which must already be initialized) send "size" bytes starting
+  // at "offset", read through "on_read" as they're needed. if "md5" isn't
+  // null, the data is read once up front to compute its hash.
+  static int SetUploadSource(base::Request *req, size_t size, off_t offset,
+                             const ReadChunk &on_read, uint8_t *md5);
+
+  // reads "size" bytes starting at "offset" through "on_read" to compute
+  // their md5 hash.
+  static int ComputeMd5(size_t size, off_t offset, const ReadChunk &on_read,
+                        uint8_t *md5);
+
   virtual int DownloadSingle(base::Request *req, const std::string &url,
-                             size_t size, const WriteChunk &on_write);
+                             size_t size, const WriteChunk &on_write,
+                             const base::CancelToken *cancel);
 
   virtual int DownloadMulti(const std::string &url, size_t size,
-                            const WriteChunk &on_write);
+                            const WriteChunk &on_write,
+                            const NextChunk &next_chunk,
+                            const SkipChunk &skip_chunk,
+                            const base::CancelToken *cancel);
 
   virtual int UploadSingle(base::Request *req, const std::string &url,
                            size_t size, const ReadChunk &on_read,
-                           std::string *returned_etag);
+                           std::string *returned_etag,
+                           const SetHeaders &set_headers);
 
   virtual int UploadMulti(const std::string &url, size_t size,
-                          const ReadChunk &on_read, std::string *returned_etag);
+                          const ReadChunk &on_read, std::string *returned_etag,
+                          const std::string &source_etag,
+                          const IsChunkUnchanged &is_unchanged,
+                          const SetHeaders &set_headers);
 };
 }  // namespace services
 }  // namespace s3
@@ -88,6 +88,8 @@ bool Impl::is_next_marker_supported() const { return false; }
 
 bool Impl::is_listobjectsv2_supported() const { return false; }
 
+bool Impl::is_strongly_consistent() const { return false; }
+
 base::RequestHook *Impl::hook() { return this; }
 
 services::FileTransfer *Impl::file_transfer() { return this; }
@@ -46,6 +46,7 @@ class Impl : public services::Impl,
 
   bool is_next_marker_supported() const override;
   bool is_listobjectsv2_supported() const override;
+  bool is_strongly_consistent() const override;
 
   base::RequestHook *hook() override;
   services::FileTransfer *file_transfer() override;
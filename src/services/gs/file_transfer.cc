@@ -28,6 +28,9 @@
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/statistics.h"
+#include "crypto/encoder.h"
+#include "crypto/hex_with_quotes.h"
+#include "crypto/md5.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
 
@@ -60,11 +63,27 @@ size_t FileTransfer::upload_chunk_size() { return upload_chunk_size_; }
 
 int FileTransfer::UploadMulti(const std::string &url, size_t size,
                               const ReadChunk &on_read,
-                              std::string *returned_etag) {
+                              std::string *returned_etag,
+                              const std::string & /* source_etag */,
+                              const IsChunkUnchanged & /* is_unchanged */,
+                              const SetHeaders &set_headers) {
+  std::string etag;
+  int r;
+  if (set_headers) {
+    // the metadata headers go on the initiating request, and have to include
+    // the etag of the finished object, which is its md5
+    uint8_t md5[crypto::Md5::HASH_LEN];
+    r = ComputeMd5(size, 0, on_read, md5);
+    if (r) return r;
+    etag = crypto::Encoder::Encode<crypto::HexWithQuotes>(
+        md5, crypto::Md5::HASH_LEN);
+  }
+
   std::string location;
-  int r = threads::Pool::Call(threads::PoolId::PR_REQ_0,
-                              bind(&FileTransfer::UploadMultiInit, this,
-                                   std::placeholders::_1, url, &location));
+  r = threads::Pool::Call(
+      threads::PoolId::PR_REQ_0,
+      bind(&FileTransfer::UploadMultiInit, this, std::placeholders::_1, url,
+           set_headers, etag, &location));
   if (r) return r;
 
   const size_t num_parts = (size + upload_chunk_size_ - 1) / upload_chunk_size_;
@@ -100,13 +119,11 @@ int FileTransfer::UploadMulti(const std::string &url, size_t size,
 int FileTransfer::ReadAndUpload(base::Request *req, const std::string &url,
                                 const ReadChunk &on_read, UploadRange *range,
                                 size_t total_size) {
-  std::vector<char> buffer;
-  int r = on_read(range->size, range->offset, &buffer);
-  if (r) return r;
-
   req->Init(base::HttpMethod::PUT);
   req->SetUrl(url);
-  req->SetInputBuffer(std::move(buffer));
+
+  int r = SetUploadSource(req, range->size, range->offset, on_read, nullptr);
+  if (r) return r;
 
   const std::string content_range =
       "bytes " + std::to_string(range->offset) + "-" +
@@ -115,7 +132,7 @@ int FileTransfer::ReadAndUpload(base::Request *req, const std::string &url,
   req->SetHeader("Content-Range", content_range);
 
   req->Run(base::Config::transfer_timeout_in_s());
-  return 0;
+  return req->input_source_error();
 }
 
 int FileTransfer::UploadPart(base::Request *req, const std::string &url,
@@ -143,10 +160,13 @@ int FileTransfer::UploadLastPart(base::Request *req, const std::string &url,
 }
 
 int FileTransfer::UploadMultiInit(base::Request *req, const std::string &url,
+                                  const SetHeaders &set_headers,
+                                  const std::string &etag,
                                   std::string *location) {
   req->Init(base::HttpMethod::POST);
   req->SetUrl(url);
   req->SetHeader("x-goog-resumable", "start");
+  if (set_headers) set_headers(req, etag);
 
   req->Run();
   if (req->response_code() != base::HTTP_SC_CREATED) return -EIO;
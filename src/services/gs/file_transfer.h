@@ -37,7 +37,9 @@ class FileTransfer : public services::FileTransfer {
 
  protected:
   int UploadMulti(const std::string &url, size_t size, const ReadChunk &on_read,
-                  std::string *returned_etag) override;
+                  std::string *returned_etag, const std::string &source_etag,
+                  const IsChunkUnchanged &is_unchanged,
+                  const SetHeaders &set_headers) override;
 
  private:
   struct UploadRange {
@@ -57,6 +59,7 @@ class FileTransfer : public services::FileTransfer {
                      size_t total_size, std::string *returned_etag);
 
   int UploadMultiInit(base::Request *req, const std::string &url,
+                      const SetHeaders &set_headers, const std::string &etag,
                       std::string *location);
 
   size_t upload_chunk_size_;
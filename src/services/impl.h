@@ -43,6 +43,8 @@ class Impl {
 
   virtual bool is_next_marker_supported() const = 0;
   virtual bool is_listobjectsv2_supported() const = 0;
+  // whether changes are visible to subsequent requests right away
+  virtual bool is_strongly_consistent() const = 0;
 
   virtual base::RequestHook *hook() = 0;
   virtual FileTransfer *file_transfer() = 0;
@@ -73,6 +73,12 @@ void Service::Init(std::unique_ptr<Impl> impl) {
   base::RequestFactory::SetHook(s_impl->hook());
 }
 
+bool Service::is_strongly_consistent() {
+  if (base::Config::strong_consistency() == -1)
+    return s_impl->is_strongly_consistent();
+  return base::Config::strong_consistency() != 0;
+}
+
 std::string Service::GetEnabledServices() {
   std::string svcs;
 #ifdef WITH_AWS
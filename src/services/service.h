@@ -54,6 +54,9 @@ class Service {
     return s_impl->is_listobjectsv2_supported();
   }
 
+  // see strong_consistency
+  static bool is_strongly_consistent();
+
   inline static FileTransfer *file_transfer() {
     return s_impl->file_transfer();
   }
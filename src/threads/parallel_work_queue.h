@@ -28,6 +28,7 @@
 #include <memory>
 #include <vector>
 
+#include "base/cancel_token.h"
 #include "base/config.h"
 #include "base/logger.h"
 #include "threads/pool.h"
@@ -43,13 +44,19 @@ class ParallelWorkQueue {
  public:
   using ProcessPartCallback = std::function<int(base::Request *, Part *)>;
   using RetryPartCallback = std::function<int(base::Request *, Part *)>;
+  // returns the (zero-based) position of a part that should be processed ahead
+  // of the others, or -1 to continue in order.
+  using NextPartCallback = std::function<int()>;
 
   template <class Iterator>
   inline ParallelWorkQueue(Iterator begin, Iterator end,
                            const ProcessPartCallback &on_process_part,
                            const RetryPartCallback &on_retry_part,
-                           int max_retries = -1, int max_parts_in_progress = -1)
-      : on_process_part_(on_process_part), on_retry_part_(on_retry_part) {
+                           int max_retries = -1, int max_parts_in_progress = -1,
+                           const NextPartCallback &on_next_part = {})
+      : on_process_part_(on_process_part),
+        on_retry_part_(on_retry_part),
+        on_next_part_(on_next_part) {
     size_t id = 0;
 
     for (Iterator iter = begin; iter != end; ++iter) {
@@ -66,15 +73,16 @@ class ParallelWorkQueue {
                                  : max_parts_in_progress;
   }
 
-  int Process() {
+  // once "cancel" is cancelled, parts in progress are waited for but no more
+  // are started (or retried), and this returns -ECANCELED
+  int Process(const base::CancelToken *cancel = nullptr) {
     size_t last_part = 0;
     std::list<PartInProgress *> parts_in_progress;
     int r = 0;
 
-    for (last_part = 0;
-         last_part < std::min(max_parts_in_progress_, parts_.size());
-         last_part++) {
-      PartInProgress *part = &parts_[last_part];
+    for (size_t i = 0; i < std::min(max_parts_in_progress_, parts_.size());
+         i++) {
+      PartInProgress *part = GetNextPart(&last_part);
 
       part->handle = threads::Pool::Post(
           PoolId::PR_REQ_1,
@@ -88,11 +96,14 @@ class ParallelWorkQueue {
       parts_in_progress.pop_front();
       int part_r = part->handle->Wait();
 
+      const bool cancelled = cancel && cancel->cancelled();
+      if (cancelled && r == 0) r = -ECANCELED;
+
       if (part_r) {
         S3_LOG(LOG_DEBUG, "ParallelWorkQueue::Process",
                "part %i returned status %i.\n", part->id, part_r);
 
-        if ((part_r == -EAGAIN || part_r == -ETIMEDOUT) &&
+        if (!cancelled && (part_r == -EAGAIN || part_r == -ETIMEDOUT) &&
             part->retry_count < max_retries_) {
           part->handle = threads::Pool::Post(
               PoolId::PR_REQ_1,
@@ -110,9 +121,7 @@ class ParallelWorkQueue {
       // keep collecting parts until we have nothing left pending
       // if one part fails, keep going but stop posting new parts
 
-      if (r == 0 && last_part < parts_.size()) {
-        part = &parts_[last_part++];
-
+      if (r == 0 && (part = GetNextPart(&last_part))) {
         part->handle = threads::Pool::Post(
             PoolId::PR_REQ_1,
             std::bind(on_process_part_, std::placeholders::_1, part->part));
@@ -129,13 +138,34 @@ class ParallelWorkQueue {
     Part *part = nullptr;
     int id = -1;
     int retry_count = -1;
+    bool posted = false;
     std::unique_ptr<AsyncHandle> handle;
   };
 
+  PartInProgress *GetNextPart(size_t *last_part) {
+    if (on_next_part_) {
+      int id;
+      while ((id = on_next_part_()) >= 0) {
+        if (static_cast<size_t>(id) < parts_.size() && !parts_[id].posted) {
+          parts_[id].posted = true;
+          return &parts_[id];
+        }
+      }
+    }
+
+    while (*last_part < parts_.size() && parts_[*last_part].posted)
+      (*last_part)++;
+    if (*last_part == parts_.size()) return nullptr;
+
+    parts_[*last_part].posted = true;
+    return &parts_[(*last_part)++];
+  }
+
   std::vector<PartInProgress> parts_;
 
   const ProcessPartCallback on_process_part_;
   const RetryPartCallback on_retry_part_;
+  const NextPartCallback on_next_part_;
 
   int max_retries_;
   size_t max_parts_in_progress_;
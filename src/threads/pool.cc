@@ -21,11 +21,18 @@
 
 #include "threads/pool.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 
+#include "base/timer.h"
 #include "threads/request_worker.h"
 #include "threads/work_item_queue.h"
 #include "threads/worker.h"
@@ -69,20 +76,80 @@ class _PoolImpl : public _Pool {
 };
 
 std::map<PoolId, std::unique_ptr<_Pool>> s_pools;
+
+// holds work items posted with CallAsyncAt() until they're due
+class _Timer {
+ public:
+  _Timer() : thread_(&_Timer::Work, this) {}
+
+  ~_Timer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+      condition_.notify_all();
+    }
+    thread_.join();
+  }
+
+  void Post(PoolId p, double time, WorkItem::WorkerFunction fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    items_.emplace(time, std::make_pair(p, std::move(fn)));
+    condition_.notify_all();
+  }
+
+ private:
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!done_) {
+      if (items_.empty()) {
+        condition_.wait(lock);
+        continue;
+      }
+      const double now = base::Timer::GetCurrentTime();
+      auto iter = items_.begin();
+      if (iter->first > now) {
+        condition_.wait_for(
+            lock, std::chrono::microseconds(
+                      static_cast<int64_t>((iter->first - now) * 1.0e6) + 1));
+        continue;
+      }
+      auto item = std::move(iter->second);
+      items_.erase(iter);
+      s_pools[item.first]->Post(std::move(item.second), {});
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::multimap<double, std::pair<PoolId, WorkItem::WorkerFunction>> items_;
+  bool done_ = false;
+  std::thread thread_;  // last, so that it starts after everything else
+};
+
+std::unique_ptr<_Timer> s_timer;
 }  // namespace
 
 void Pool::Init() {
   s_pools[PoolId::PR_0].reset(new _PoolImpl<Worker>("PR_0"));
   s_pools[PoolId::PR_REQ_0].reset(new _PoolImpl<RequestWorker>("PR_REQ_0"));
   s_pools[PoolId::PR_REQ_1].reset(new _PoolImpl<RequestWorker>("PR_REQ_1"));
+  s_timer.reset(new _Timer());
 }
 
-void Pool::Terminate() { s_pools.clear(); }
+void Pool::Terminate() {
+  // items that aren't due yet are dropped
+  s_timer.reset();
+  s_pools.clear();
+}
 
 void Pool::Post(PoolId p, WorkItem::WorkerFunction fn,
                 WorkItem::CallbackFunction cb) {
   s_pools[p]->Post(fn, cb);
 }
 
+void Pool::CallAsyncAt(PoolId p, double time, WorkItem::WorkerFunction fn) {
+  s_timer->Post(p, time, std::move(fn));
+}
+
 }  // namespace threads
 }  // namespace s3
@@ -55,6 +55,11 @@ class Pool {
   inline static void CallAsync(PoolId p, WorkItem::WorkerFunction fn) {
     Post(p, fn, {});
   }
+
+  // like CallAsync(), but posts "fn" once base::Timer::GetCurrentTime()
+  // reaches "time". one thread holds these until they're due, so no worker
+  // waits for them.
+  static void CallAsyncAt(PoolId p, double time, WorkItem::WorkerFunction fn);
 };
 }  // namespace threads
 }  // namespace s3